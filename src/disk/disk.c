@@ -68,6 +68,9 @@ void mkdir_r(const char *path) {
 }
 
 static void disk_deinit() {
+	/* Queued chunks go to disk before the files are closed */
+	chunk_writer_quit();
+
 	if (world_control && world_control != MAP_FAILED)
 		munmap(world_control, sizeof(WorldControl));
 
@@ -196,6 +199,7 @@ void disk_init() {
 
 	/* Initialize worldctrl */
 	world_control_init(world_control);
+	chunk_writer_init();
 }
 
 #ifdef _WIN32
@@ -260,4 +264,24 @@ int munmap(void *addr, size_t length) {
 	}
 	return 0;
 }
+
+/* Reads and writes at an offset don't share the file position, so the chunk
+ * writer and the main thread can use the same file */
+ssize_t pread(int fd, void *buf, size_t count, off_t offset) {
+	OVERLAPPED ov = {.Offset	 = (DWORD)(offset & 0xFFFFFFFF),
+					 .OffsetHigh = (DWORD)((uint64_t)offset >> 32)};
+	DWORD	   done;
+	if (!ReadFile((HANDLE)_get_osfhandle(fd), buf, count, &done, &ov))
+		return -1;
+	return done;
+}
+
+ssize_t pwrite(int fd, const void *buf, size_t count, off_t offset) {
+	OVERLAPPED ov = {.Offset	 = (DWORD)(offset & 0xFFFFFFFF),
+					 .OffsetHigh = (DWORD)((uint64_t)offset >> 32)};
+	DWORD	   done;
+	if (!WriteFile((HANDLE)_get_osfhandle(fd), buf, count, &done, &ov))
+		return -1;
+	return done;
+}
 #endif
@@ -29,6 +29,8 @@
 void *mmap(void *addr, size_t length, int prot, int flags, int fd,
 		   off_t offset);
 int	  munmap(void *addr, size_t length);
+ssize_t pread(int fd, void *buf, size_t count, off_t offset);
+ssize_t pwrite(int fd, const void *buf, size_t count, off_t offset);
 /* Unused */
 #define MAP_SHARED 0
 #else
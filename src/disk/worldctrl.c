@@ -1,5 +1,7 @@
 #include "worldctrl.h"
 
+#include <SDL.h>
+
 #include "disk.h"
 
 #include "../log/log.h"
@@ -21,36 +23,227 @@ void world_control_init(WorldControl *world_control) {
 	}
 }
 
-void save_chunk_to_disk(Chunk chunk_id, GO_ID *chunk_data) {
-	/* Check if OS have enough space to work */
+/** Chunk waiting for the writer, at its place in the data file */
+typedef struct _WriteChunk {
+	Chunk	  chunk_id;
+	catable_t chunk_file_idx;
+	bool	  new_entry; /* Its catable entry was made for this save */
+	GO_ID	  chunk_data[CHUNK_MEMSIZE];
+} WriteChunk;
+
+/* Ring of queued chunks, the first one is being written. The queue is shared
+ * under m_write_lock, the catable is only touched by the main thread. */
+static WriteChunk	m_write_queue[CHUNK_WRITER_QUEUE];
+static size_t		m_write_first;
+static size_t		m_write_count;
+static SDL_mutex   *m_write_lock;
+static SDL_cond	   *m_write_queued; /* Signaled when a chunk is queued */
+static SDL_cond	   *m_write_done;	/* Signaled when a chunk is written */
+static SDL_Thread  *m_writer;
+static bool			m_write_quit;
+static bool			m_write_failed; /* The first chunk couldn't be written */
+
+/** Returns false if the chunk couldn't be written */
+static bool write_chunk(catable_t chunk_file_idx, const GO_ID *chunk_data) {
+	/* Save chunk to disk */
+	const off_t file_offset = (off_t)chunk_file_idx * CHUNK_MEMSIZE;
+
+	if (pwrite(world_data_fd, chunk_data, CHUNK_MEMSIZE, file_offset) !=
+		CHUNK_MEMSIZE) {
+		logerr("save_chunk_to_disk: write failed: %lu", errno);
+		return false;
+	}
+
+	return true;
+}
+
+static int chunk_writer(void *data) {
+	(void)data;
+
+	SDL_LockMutex(m_write_lock);
+	for (;;) {
+		if (m_write_count == 0 || m_write_failed) {
+			if (m_write_quit)
+				break;
+			SDL_CondWait(m_write_queued, m_write_lock);
+			continue;
+		}
+
+		/* Nobody else changes the first chunk until it's dequeued */
+		const WriteChunk *queued = &m_write_queue[m_write_first];
+		SDL_UnlockMutex(m_write_lock);
+		const bool written =
+			write_chunk(queued->chunk_file_idx, queued->chunk_data);
+		SDL_LockMutex(m_write_lock);
+
+		/* Keep the chunk queued, so it's still read from here, and wait until
+		 * the next save, flush or quit to try it again */
+		if (!written) {
+			m_write_failed = true;
+			SDL_CondBroadcast(m_write_done);
+			continue;
+		}
+
+		m_write_first = (m_write_first + 1) % CHUNK_WRITER_QUEUE;
+		--m_write_count;
+		SDL_CondBroadcast(m_write_done);
+	}
+	SDL_UnlockMutex(m_write_lock);
+
+	return 0;
+}
+
+void chunk_writer_init() {
+	m_write_first  = 0;
+	m_write_count  = 0;
+	m_write_quit   = false;
+	m_write_failed = false;
+	m_write_lock   = SDL_CreateMutex();
+	m_write_queued = SDL_CreateCond();
+	m_write_done   = SDL_CreateCond();
+
+	/* Without a writer, chunks are saved as they come */
+	m_writer = SDL_CreateThread(chunk_writer, "chunk_writer", NULL);
+	if (m_writer == NULL)
+		logerr("chunk_writer_init: Can't start the writer: %s",
+			   SDL_GetError());
+}
+
+/** Let the writer try the first chunk again, if it failed. Call with
+ * m_write_lock held. */
+static void retry_chunk_writer() {
+	if (m_write_failed) {
+		m_write_failed = false;
+		SDL_CondSignal(m_write_queued);
+	}
+}
+
+bool chunk_writer_flush() {
+	if (m_writer == NULL)
+		return true;
+
+	SDL_LockMutex(m_write_lock);
+	retry_chunk_writer();
+	while (m_write_count > 0 && !m_write_failed)
+		SDL_CondWait(m_write_done, m_write_lock);
+	const bool	 flushed = !m_write_failed;
+	const size_t left	 = m_write_count;
+	SDL_UnlockMutex(m_write_lock);
+
+	if (!flushed)
+		logerr("chunk_writer_flush: %zu chunks couldn't be saved", left);
+	return flushed;
+}
+
+bool chunk_writer_quit() {
+	if (m_writer == NULL)
+		return true;
+
+	SDL_LockMutex(m_write_lock);
+	m_write_quit = true;
+	retry_chunk_writer();
+	SDL_CondSignal(m_write_queued);
+	SDL_UnlockMutex(m_write_lock);
+
+	SDL_WaitThread(m_writer, NULL);
+	m_writer = NULL;
+
+	/* The chunks left were never written. The catable entries made for them
+	 * point to nothing, drop them so the chunks aren't read from there. */
+	const bool flushed = m_write_count == 0;
+	if (!flushed)
+		logerr("chunk_writer_quit: %zu chunks couldn't be saved",
+			   m_write_count);
+	for (; m_write_count > 0; --m_write_count) {
+		const WriteChunk *queued = &m_write_queue[m_write_first];
+		if (queued->new_entry)
+			world_control->catable[CHUNK_ID(queued->chunk_id)] =
+				INVALID_CATABLE;
+		m_write_first = (m_write_first + 1) % CHUNK_WRITER_QUEUE;
+	}
+
+	SDL_DestroyCond(m_write_done);
+	SDL_DestroyCond(m_write_queued);
+	SDL_DestroyMutex(m_write_lock);
+
+	return flushed;
+}
+
+/** Returns the newest queued chunk, or NULL. Call with m_write_lock held. */
+static WriteChunk *find_queued_chunk(Chunk chunk_id) {
+	for (size_t k = m_write_count; k-- > 0;) {
+		WriteChunk *queued =
+			&m_write_queue[(m_write_first + k) % CHUNK_WRITER_QUEUE];
+		if (CHUNK_ID(queued->chunk_id) == CHUNK_ID(chunk_id))
+			return queued;
+	}
+
+	return NULL;
+}
+
+bool save_chunk_to_disk(Chunk chunk_id, GO_ID *chunk_data) {
+	/* Check if OS have enough space to work, before the chunk gets a place in
+	 * the data file */
 	const size_t free_space = check_disk_space(user_path);
 	if (free_space < _1G) {
 		logerr("save_chunk_to_disk: Disk small or running out of space "
 			   "(<1GB).\nFree space: %zu MB\n",
 			   free_space / _1M);
-		exit(1);
+		return false;
 	}
 
-	catable_t chunk_file_idx = world_control->catable[CHUNK_ID(chunk_id)];
+	catable_t  chunk_file_idx = world_control->catable[CHUNK_ID(chunk_id)];
+	const bool new_entry	  = chunk_file_idx == INVALID_CATABLE;
 
 	/* Create entry if it doesn't exist, and update m_next_off_chunk */
-	if (chunk_file_idx == INVALID_CATABLE) {
+	if (new_entry) {
 		chunk_file_idx = m_next_off_chunk++;
 		/* Update catable */
 		world_control->catable[CHUNK_ID(chunk_id)] = chunk_file_idx;
 	}
 
-	/* Save chunk to disk */
-	off_t file_offset = chunk_file_idx * CHUNK_MEMSIZE;
+	if (m_writer == NULL) {
+		if (write_chunk(chunk_file_idx, chunk_data))
+			return true;
 
-	if (lseek(world_data_fd, file_offset, SEEK_SET) < 0) {
-		logerr("save_chunk_to_disk: lseek failed: %lu", errno);
-		return;
+		/* The entry made for it points to nothing */
+		if (new_entry)
+			world_control->catable[CHUNK_ID(chunk_id)] = INVALID_CATABLE;
+		return false;
 	}
 
-	if (write(world_data_fd, chunk_data, CHUNK_MEMSIZE) != CHUNK_MEMSIZE) {
-		logerr("save_chunk_to_disk: write failed: %lu", errno);
+	SDL_LockMutex(m_write_lock);
+	retry_chunk_writer();
+
+	/* Still waiting behind the first, the newer data takes its place */
+	WriteChunk *queued = find_queued_chunk(chunk_id);
+	if (queued != NULL && queued != &m_write_queue[m_write_first]) {
+		memcpy(queued->chunk_data, chunk_data, CHUNK_MEMSIZE);
+		SDL_UnlockMutex(m_write_lock);
+		return true;
 	}
+
+	/* A writer that fails meanwhile doesn't make room until it's retried */
+	while (m_write_count == CHUNK_WRITER_QUEUE && !m_write_failed)
+		SDL_CondWait(m_write_done, m_write_lock);
+	if (m_write_count == CHUNK_WRITER_QUEUE) {
+		SDL_UnlockMutex(m_write_lock);
+		if (new_entry)
+			world_control->catable[CHUNK_ID(chunk_id)] = INVALID_CATABLE;
+		logerr("save_chunk_to_disk: The writer couldn't save chunks");
+		return false;
+	}
+	queued = &m_write_queue[(m_write_first + m_write_count++) %
+							CHUNK_WRITER_QUEUE];
+	queued->chunk_id	   = chunk_id;
+	queued->chunk_file_idx = chunk_file_idx;
+	queued->new_entry	   = new_entry;
+	memcpy(queued->chunk_data, chunk_data, CHUNK_MEMSIZE);
+
+	SDL_CondSignal(m_write_queued);
+	SDL_UnlockMutex(m_write_lock);
+
+	return true;
 }
 
 int load_chunk_from_disk(Chunk chunk_id, void *chunk_data) {
@@ -58,14 +251,22 @@ int load_chunk_from_disk(Chunk chunk_id, void *chunk_data) {
 	if (chunk_file_idx == INVALID_CATABLE)
 		return 0; /* Chunk not stored in disk */
 
-	off_t file_offset = chunk_file_idx * CHUNK_MEMSIZE;
+	/* Not written yet, or being written */
+	if (m_writer != NULL) {
+		SDL_LockMutex(m_write_lock);
+		const WriteChunk *queued = find_queued_chunk(chunk_id);
+		if (queued != NULL)
+			memcpy(chunk_data, queued->chunk_data, CHUNK_MEMSIZE);
+		SDL_UnlockMutex(m_write_lock);
 
-	if (lseek(world_data_fd, file_offset, SEEK_SET) < 0) {
-		logerr("load_chunk_from_disk: lseek failed: %lu", errno);
-		return 0;
+		if (queued != NULL)
+			return 1;
 	}
 
-	if (read(world_data_fd, chunk_data, CHUNK_MEMSIZE) != CHUNK_MEMSIZE) {
+	const off_t file_offset = (off_t)chunk_file_idx * CHUNK_MEMSIZE;
+
+	if (pread(world_data_fd, chunk_data, CHUNK_MEMSIZE, file_offset) !=
+		CHUNK_MEMSIZE) {
 		logerr("load_chunk_from_disk: read failed: %lu", errno);
 		return 0;
 	}
@@ -45,7 +45,33 @@ extern int world_data_fd;
 extern WorldControl *world_control;
 
 void world_control_init(WorldControl *world_control);
-void save_chunk_to_disk(Chunk chunk, GO_ID *chunk_data);
-int	 load_chunk_from_disk(Chunk chunk, void *chunk_data);
+
+/** Queues a snapshot of the chunk for the writer, waiting for room if the
+ * queue is full. Written right away when there is no writer. Returns false if
+ * it couldn't be saved nor queued, it has to be saved again later. */
+bool save_chunk_to_disk(Chunk chunk, GO_ID *chunk_data);
+
+/** Reads the chunk, from the writer queue if it's still there. Returns 0 if it
+ * was never saved. */
+int load_chunk_from_disk(Chunk chunk, void *chunk_data);
+
+/*
+ * Chunk writer.
+ * An I/O thread writes the queued chunks, so that disk latency stays out of
+ * the frame. The queue is bounded, a chunk queued twice takes a single slot.
+ */
+#define CHUNK_WRITER_QUEUE 8
+
+void chunk_writer_init();
+
+/** Waits until every chunk queued so far is on disk. Returns false if the
+ * writer failed, its chunks are kept queued and tried again with the next save
+ * or flush. */
+bool chunk_writer_flush();
+
+/** Drains the queue and stops the writer, saves are synchronous afterwards.
+ * Returns false if the writer still fails, then the chunks left are dropped
+ * along with the catable entries made for them. */
+bool chunk_writer_quit();
 
 #endif // _WORLDCTRL_H
@@ -3,15 +3,22 @@
 #include "noise.h"
 
 #include "../disk/worldctrl.h"
+#include "../log/log.h"
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
 
 int DEBUG_LEVEL = e_dbgl_none;
 
 size_t WORLD_SEED = 0;
 size_t frame_cx	  = 0;
+size_t sim_tick	  = 0;
 
 GO_ID gameboard[VSCREEN_HEIGHT][VSCREEN_WIDTH];
 
-Color vscreen[VIEWPORT_WIDTH * VIEWPORT_HEIGHT];
+size_t gameboard_ox = 0;
+size_t gameboard_oy = 0;
 
 b2World *b2_world = NULL;
 
@@ -22,8 +29,142 @@ b2World *b2_world = NULL;
  */
 subchunk_t subchunkopt[SUBCHUNK_SIZE];
 
+/** Only the cells inside these rects are updated in the next frame */
+SubchunkRect subchunk_rect[SUBCHUNK_SIZE][SUBCHUNK_SIZE];
+
 SoilData soil_body[SUBCHUNK_SIZE][SUBCHUNK_SIZE];
 
+movemap_t movemap[VSCREEN_HEIGHT][MOVEMAP_WIDTH];
+movemap_t awakemap[VSCREEN_HEIGHT][MOVEMAP_WIDTH];
+
+GO_State gamestate[VSCREEN_HEIGHT][VSCREEN_WIDTH];
+
+/* The look of the gameboard, laid out like the ring so it stays in place when
+ * the view scrolls. Cells are only drawn again when their bit is set in the
+ * drawmap, cells out of view keep it until they come into view. */
+static Color	 m_worldbuffer[VSCREEN_HEIGHT][VSCREEN_WIDTH];
+static movemap_t m_drawmap[VSCREEN_HEIGHT][MOVEMAP_WIDTH];
+
+/** Draw the cell (gx, gy) of the ring again. Plain read-modify-write, like
+ * movemap_set(). */
+static inline void drawmap_set(const size_t gx, const size_t gy) {
+	m_drawmap[gy][gx / MOVEMAP_BITS] |= MOVEMAP_BIT(gx);
+}
+
+/* GO_NONE is static too */
+#define GO_IS_MOVABLE(_go) (GO_TYPE(_go) != GO_STATIC)
+
+void gameboard_chunk_loaded(const size_t vx, const size_t vy) {
+	/* Loaded cells are awake but rested, so they go to sleep as soon as they
+	 * fail to move */
+	const GO_State rested = {.rest = GO_REST_TICKS};
+
+	/* Chunk rows are contiguous in the ring */
+	for (size_t j = vy; j < vy + CHUNK_SIZE; ++j) {
+		const GO_ID *row  = &GAMEBOARD(vx, j);
+		movemap_t	*word = &MOVEMAP_WORD(movemap, vx, j);
+		for (size_t w = 0; w < CHUNK_SIZE / MOVEMAP_BITS; ++w) {
+			movemap_t bits = 0;
+			for (size_t b = 0; b < MOVEMAP_BITS; ++b) {
+				if (GO_IS_MOVABLE(row[w * MOVEMAP_BITS + b]))
+					bits |= (movemap_t)1 << b;
+			}
+			word[w] = bits;
+		}
+		memset(&MOVEMAP_WORD(awakemap, vx, j), 0xFF,
+			   CHUNK_SIZE / MOVEMAP_BITS * sizeof(movemap_t));
+		memset(&MOVEMAP_WORD(m_drawmap, vx, j), 0xFF,
+			   CHUNK_SIZE / MOVEMAP_BITS * sizeof(movemap_t));
+		memset(&GAMESTATE(vx, j), rested.raw, CHUNK_SIZE);
+	}
+
+	const size_t si0 = vx / SUBCHUNK_WIDTH;
+	const size_t sj0 = vy / SUBCHUNK_HEIGHT;
+	for (size_t sj = sj0; sj < sj0 + SUBCHUNKS_PER_CHUNK; ++sj) {
+		for (size_t si = si0; si < si0 + SUBCHUNKS_PER_CHUNK; ++si) {
+			subchunk_rect[sj][si] = SUBCHUNK_RECT_FULL;
+			subchunk_set(si, sj);
+		}
+	}
+
+	/* The cells next to the chunk may move into it, or they stood by the
+	 * border of the view until now */
+	for (size_t k = 0; k < CHUNK_SIZE; ++k) {
+		subchunk_mark_world(vx + k, vy);
+		subchunk_mark_world(vx + k, vy + CHUNK_SIZE - 1);
+		subchunk_mark_world(vx, vy + k);
+		subchunk_mark_world(vx + CHUNK_SIZE - 1, vy + k);
+	}
+}
+
+#define SUBCHUNK_IN_VIEW(_i, _j)                                               \
+	((size_t)(_i) < SUBCHUNK_SIZE && (size_t)(_j) < SUBCHUNK_SIZE)
+
+/** Move the subchunks along with the view, see gameboard_scroll() */
+static void subchunks_scroll(const ssize_t dx, const ssize_t dy) {
+	/* The subchunk (si, sj) takes the state of (si + di, sj + dj) */
+	const ssize_t di = dx * SUBCHUNKS_PER_CHUNK;
+	const ssize_t dj = dy * SUBCHUNKS_PER_CHUNK;
+
+	/* The soil that leaves the view goes away. The bodies of the rest were
+	 * already moved with box2d_world_move_all_bodies(). */
+	for (ssize_t sj = 0; sj < SUBCHUNK_SIZE; ++sj) {
+		for (ssize_t si = 0; si < SUBCHUNK_SIZE; ++si) {
+			if (!SUBCHUNK_IN_VIEW(si - di, sj - dj))
+				deactivate_soil(si, sj);
+		}
+	}
+
+	subchunk_t	 opt[SUBCHUNK_SIZE];
+	SubchunkRect rect[SUBCHUNK_SIZE][SUBCHUNK_SIZE];
+	SoilData	 soil[SUBCHUNK_SIZE][SUBCHUNK_SIZE];
+	memcpy(opt, subchunkopt, sizeof(opt));
+	memcpy(rect, subchunk_rect, sizeof(rect));
+	memcpy(soil, soil_body, sizeof(soil));
+
+	/* Subchunks coming into the view are left inactive, until their chunk is
+	 * loaded */
+	for (ssize_t sj = 0; sj < SUBCHUNK_SIZE; ++sj) {
+		subchunkopt[sj] = 0;
+		for (ssize_t si = 0; si < SUBCHUNK_SIZE; ++si) {
+			const ssize_t i = si + di;
+			const ssize_t j = sj + dj;
+			if (!SUBCHUNK_IN_VIEW(i, j)) {
+				subchunk_rect[sj][si]  = SUBCHUNK_RECT_EMPTY;
+				soil_body[sj][si].body = NULL;
+				continue;
+			}
+
+			if (opt[j] & BIT(i))
+				subchunkopt[sj] |= BIT(si);
+			subchunk_rect[sj][si] = rect[j][i];
+			soil_body[sj][si]	  = soil[j][i];
+		}
+	}
+}
+
+void gameboard_scroll(const ssize_t dx, const ssize_t dy) {
+	/* The origin is never negative, go around the ring forwards */
+	gameboard_ox = (gameboard_ox + VSCREEN_WIDTH + dx * CHUNK_SIZE) %
+				   VSCREEN_WIDTH;
+	gameboard_oy = (gameboard_oy + VSCREEN_HEIGHT + dy * CHUNK_SIZE) %
+				   VSCREEN_HEIGHT;
+
+	subchunks_scroll(dx, dy);
+}
+
+void gameboard_set(const size_t x, const size_t y, const GO_ID go) {
+	GAMEBOARD(x, y)		= go;
+	GAMESTATE(x, y).raw = 0;
+	if (GO_IS_MOVABLE(go))
+		movemap_set(x, y);
+	else
+		movemap_unset(x, y);
+	awakemap_set(x, y);
+	drawmap_set(GB_X(x), GB_Y(y));
+	subchunk_set_world(x, y);
+}
+
 const Chunk CHUNK_ID_VALID_MASK = ((Chunk){
 	.x		  = CHUNK_MAX_X,
 	.y		  = CHUNK_MAX_Y,
@@ -33,33 +174,30 @@ const Chunk CHUNK_ID_VALID_MASK = ((Chunk){
 
 Chunk vctable[3][3];
 
-void generate_chunk(seed_t SEED, Chunk CHUNK, const size_t vx,
-					const size_t vy) {
+void generate_chunk(seed_t SEED, Chunk CHUNK, GO_ID *chunk_data,
+					const size_t y0, const size_t y1) {
+	GO_ID		*rows	   = chunk_data + (y0 * CHUNK_SIZE);
+	const size_t rows_size = (y1 - y0) * CHUNK_SIZE;
+
 	/* Check world borders */
 	if (CHUNK.y < GEN_SKY_Y ||
 		(CHUNK.y <= GEN_TOP_LAYER_Y &&
 		 (CHUNK.x < GEN_WATERSEA_OFFSET_X ||
 		  CHUNK.x > CHUNK_MAX_X - GEN_WATERSEA_OFFSET_X))) {
 		/* Empty sky */
-		for (uint_fast16_t y = vy; y < vy + CHUNK_SIZE; ++y)
-			memset(&gameboard[y][vx], GO_NONE.raw, CHUNK_SIZE);
+		memset(rows, GO_NONE.raw, rows_size);
 		return;
 	} else if (CHUNK.y > CHUNK_MAX_X - GEN_BEDROCK_MARGIN_Y) {
 		/* Bedrock */
-		for (uint_fast16_t y = vy; y < vy + CHUNK_SIZE; ++y)
-			memset(&gameboard[y][vx], GO_STONE.raw, CHUNK_SIZE);
+		memset(rows, GO_STONE.raw, rows_size);
 		return;
 	} else if (CHUNK.x < GEN_WATERSEA_OFFSET_X ||
 			   CHUNK.x > CHUNK_MAX_X - GEN_WATERSEA_OFFSET_X) {
 		/* Water sea */
-		for (uint_fast16_t y = vy; y < vy + CHUNK_SIZE; ++y)
-			memset(&gameboard[y][vx], GO_WATER.raw, CHUNK_SIZE);
+		memset(rows, GO_WATER.raw, rows_size);
 		return;
 	}
 
-	// const uint_fast16_t vx_max = clamp_high(vx + CHUNK_SIZE, VSCREEN_WIDTH);
-	const uint_fast16_t vy_max = clamp_high(vy + CHUNK_SIZE, VSCREEN_HEIGHT);
-
 	const uint_fast64_t world_x0 = CHUNK.x * CHUNK_SIZE;
 	const uint_fast64_t world_y0 = CHUNK.y * CHUNK_SIZE;
 
@@ -84,21 +222,19 @@ void generate_chunk(seed_t SEED, Chunk CHUNK, const size_t vx,
 
 		if (chunk_full_sand) {
 			/* Fill with sand */
-			for (uint_fast16_t y = vy; y < vy_max; ++y)
-				memset(&gameboard[y][vx], GO_SAND.raw, CHUNK_SIZE);
+			memset(rows, GO_SAND.raw, rows_size);
 			return;
 		}
 
 		/* Empty base or sky */
-		for (uint_fast16_t y = vy; y < vy_max; ++y)
-			memset(&gameboard[y][vx], GO_NONE.raw, CHUNK_SIZE);
+		memset(rows, GO_NONE.raw, rows_size);
 
 		if (!chunk_vvalid)
 			/* Not a shore, it's the sky, exit */
 			return;
 
-		uint_fast16_t y0 = alternate ? 0 : CHUNK_SIZE_DIV_2;
-		uint_fast16_t cx = is_right_shore ? 0 : CHUNK_SIZE_DIV_2;
+		uint_fast16_t shore_y0 = alternate ? 0 : CHUNK_SIZE_DIV_2;
+		uint_fast16_t cx	   = is_right_shore ? 0 : CHUNK_SIZE_DIV_2;
 		for (uint_fast16_t x = 0; x < CHUNK_SIZE; ++x) {
 			if (x % 2 == 0) {
 				if (is_right_shore)
@@ -107,24 +243,18 @@ void generate_chunk(seed_t SEED, Chunk CHUNK, const size_t vx,
 					--cx;
 			}
 
-			const uint_fast16_t gbx = vx + x;
-
-			for (uint_fast16_t y = y0 + cx; y < CHUNK_SIZE; ++y) {
-				const uint_fast16_t gby = vy + y;
-				gameboard[gby][gbx].raw = GO_SAND.raw;
-			}
+			for (uint_fast16_t y = clamp_low(shore_y0 + cx, y0); y < y1; ++y)
+				chunk_data[y * CHUNK_SIZE + x].raw = GO_SAND.raw;
 		}
 		return;
 	}
 
 	/* Rock base */
-	for (uint_fast16_t y = vy; y < vy_max; ++y)
-		memset(&gameboard[y][vx], GO_STONE.raw, CHUNK_SIZE);
+	memset(rows, GO_STONE.raw, rows_size);
 
 	/* GENERATE */
 	for (uint_fast16_t x = 0; x < CHUNK_SIZE; ++x) {
 		const uint_fast64_t world_x = world_x0 + x;
-		const uint_fast16_t gbx		= vx + x;
 
 		const uint_fast64_t ground_height =
 			(CHUNK.y < GEN_TOP_LAYER_Y)
@@ -132,320 +262,973 @@ void generate_chunk(seed_t SEED, Chunk CHUNK, const size_t vx,
 					  ((GEN_TOP_LAYER_Y - GEN_SKY_Y) * CHUNK_SIZE)
 				: 0;
 
-		for (uint_fast16_t y = 0; y < CHUNK_SIZE; ++y) {
+		for (uint_fast16_t y = y0; y < y1; ++y) {
 			const uint_fast64_t world_y = world_y0 + y;
-			const uint_fast16_t gby		= vy + y;
+			GO_ID			   *cell	= &chunk_data[y * CHUNK_SIZE + x];
 
 			if (CHUNK.y < GEN_TOP_LAYER_Y) {
 				const uint_fast64_t ground =
 					(GEN_SKY_Y * CHUNK_SIZE) + ground_height;
 
 				if (world_y < ground) {
-					gameboard[gby][gbx] = GO_NONE;
+					*cell = GO_NONE;
 					continue;
 				}
 			}
 
 			const double noise = perlin2d(SEED, world_x, world_y, 0.007, 4);
 			if (noise > 0.88) {
-				gameboard[gby][gbx] = GO_NONE;
+				*cell = GO_NONE;
 			} else if (noise > 0.75) {
-				gameboard[gby][gbx].raw = GO_WATER.raw;
+				cell->raw = GO_WATER.raw;
 			} else if (noise > 0.6) {
-				gameboard[gby][gbx].raw = GO_SAND.raw;
+				cell->raw = GO_SAND.raw;
 			}
 		}
 	}
 }
 
-#define CHUNK_CACHE_SIZE	32
-#define CHUNK_CACHE_SIZE_M1 (CHUNK_CACHE_SIZE - 1)
+#define CHUNK_CACHE_NONE	  UINT32_MAX
+#define CHUNK_CACHE_HUGE_PAGE (2 * 1024 * 1024)
+#define CHUNK_CACHE_ALIGN(_n) GRIDALIGN(((_n) + 63), 64)
+/* Packed chunks leaving the cache soon enough to be saved ahead of time */
+#define CHUNK_CACHE_WRITEBACK 3
+
+/* Hot tier, raw chunks replaced by a clock */
+static CacheChunk *m_cached_chunks;
+static size_t	   m_cache_size;
+
+/* First entry of every bucket, the others follow CacheChunk.next */
+static uint32_t *m_cache_buckets;
+static size_t	 m_cache_bits;
+
+/* Clock hand, the next entry that may be replaced */
+static size_t m_cache_hand;
+
+/* Cold tier. The clock packs the chunks it replaces at the end of a log, and
+ * the oldest ones fall off when it runs out of room. Entries are queued in log
+ * order, those that went back to the hot tier are left as holes. */
+static PackedChunk *m_packed_chunks;
+static size_t		m_packed_size;
+static size_t		m_packed_first; /* Oldest entry */
+static size_t		m_packed_count;
+static uint32_t	   *m_packed_buckets;
+static size_t		m_packed_bits;
+static uint8_t	   *m_packed_log;
+static size_t		m_packed_log_size;
+static size_t		m_packed_head; /* Log bytes ever written */
+
+/* The chunk the clock replaced, packed until it's in the log */
+static uint8_t m_pack_buffer[CHUNK_MEMSIZE];
+/* Packed chunks are unpacked here to be saved */
+static GO_ID m_unpack_buffer[CHUNK_MEMSIZE];
+
+static CacheStats m_cache_stats;
+
+static inline size_t cache_bucket(Chunk chunk_id, const size_t bits) {
+	return (uint32_t)(CHUNK_ID(chunk_id) * UINT32_C(2654435761)) >>
+		   (32 - bits);
+}
+
+/** Bucket bits for twice as many buckets as entries */
+static size_t cache_bucket_bits(const size_t entries) {
+	size_t bits = 1;
+	while (((size_t)1 << bits) < entries * 2)
+		++bits;
+	return bits;
+}
 
-static CacheChunk m_cached_chunks[CHUNK_CACHE_SIZE];
+/*
+ * Packed chunks.
+ * Cells are 7 bit ids, the updated flag is cleared before caching. A byte with
+ * the high bit set starts a run of PACK_RUN_MIN cells or more, the length left
+ * follows in groups of 7 bits, lowest first. Other bytes are single cells, so
+ * a packed chunk is never larger than a raw one.
+ */
+#define PACK_RUN_MIN 3
+
+static size_t pack_chunk(const GO_ID *chunk_data, uint8_t *packed) {
+	size_t size = 0;
+	for (size_t i = 0; i < CHUNK_MEMSIZE;) {
+		const uint8_t cell = chunk_data[i].raw;
+
+		size_t run = 1;
+		while (i + run < CHUNK_MEMSIZE && chunk_data[i + run].raw == cell)
+			++run;
+		i += run;
+
+		if (run < PACK_RUN_MIN) {
+			memset(packed + size, cell, run);
+			size += run;
+			continue;
+		}
 
-static size_t m_cc_idx;
+		packed[size++] = 0x80 | cell;
+		for (run -= PACK_RUN_MIN; run >= 0x80; run >>= 7)
+			packed[size++] = 0x80 | (run & 0x7F);
+		packed[size++] = run;
+	}
 
-void cache_chunk_init() {
-	memset(m_cached_chunks, INVALID_CACHE_CHUNK, sizeof(m_cached_chunks));
-	m_cc_idx = 0;
+	return size;
 }
 
-void cache_chunk_flushall() {
-	for (size_t i = 0; i < CHUNK_CACHE_SIZE; ++i) {
-		Chunk cid = m_cached_chunks[i].chunk_id;
-		if (cid.id != INVALID_CACHE_CHUNK) {
-			save_chunk_to_disk(cid, m_cached_chunks[i].chunk_data);
+static void unpack_chunk(const uint8_t *packed, const size_t size,
+						 GO_ID *chunk_data) {
+	size_t i = 0;
+	for (size_t k = 0; k < size;) {
+		const uint8_t byte = packed[k++];
+		if (!(byte & 0x80)) {
+			chunk_data[i++].raw = byte;
+			continue;
+		}
+
+		size_t run = 0;
+		for (size_t shift = 0;; shift += 7) {
+			const uint8_t group = packed[k++];
+			run |= (size_t)(group & 0x7F) << shift;
+			if (!(group & 0x80))
+				break;
 		}
+		run += PACK_RUN_MIN;
+
+		memset(chunk_data + i, byte & 0x7F, run);
+		i += run;
 	}
 }
 
-void cache_chunk(Chunk chunk_id, const size_t vy, const size_t vx) {
-	/* Get cached chunk ready to store */
-	CacheChunk *cache_chunk = &m_cached_chunks[m_cc_idx];
-
-	/* If cache is not full, iterate until m_cc_idx */
-	const uint_fast8_t max_cache_idx =
-		(m_cached_chunks[CHUNK_CACHE_SIZE_M1].chunk_id.id ==
-		 INVALID_CACHE_CHUNK)
-			? m_cc_idx
-			: CHUNK_CACHE_SIZE;
-
-	/* Search for already cached chunk to overwrite instead */
-	for (size_t i = 0; i < max_cache_idx; ++i) {
-		if (CHUNK_ID(m_cached_chunks[i].chunk_id) == CHUNK_ID(chunk_id)) {
-			cache_chunk = &m_cached_chunks[i];
-			break;
+static CacheChunk *find_cached_chunk(Chunk chunk_id) {
+	for (uint32_t i = m_cache_buckets[cache_bucket(chunk_id, m_cache_bits)];
+		 i != CHUNK_CACHE_NONE; i = m_cached_chunks[i].next) {
+		if (CHUNK_ID(m_cached_chunks[i].chunk_id) == CHUNK_ID(chunk_id))
+			return &m_cached_chunks[i];
+	}
+
+	return NULL;
+}
+
+static PackedChunk *find_packed_chunk(Chunk chunk_id) {
+	for (uint32_t i = m_packed_buckets[cache_bucket(chunk_id, m_packed_bits)];
+		 i != CHUNK_CACHE_NONE; i = m_packed_chunks[i].next) {
+		if (CHUNK_ID(m_packed_chunks[i].chunk_id) == CHUNK_ID(chunk_id))
+			return &m_packed_chunks[i];
+	}
+
+	return NULL;
+}
+
+static inline const uint8_t *packed_data(const PackedChunk *packed) {
+	return &m_packed_log[packed->offset % m_packed_log_size];
+}
+
+/** Takes a packed chunk out of its bucket, leaving a hole in the log */
+static void unlink_packed_chunk(PackedChunk *packed) {
+	const uint32_t idx = packed - m_packed_chunks;
+
+	uint32_t *link =
+		&m_packed_buckets[cache_bucket(packed->chunk_id, m_packed_bits)];
+	while (*link != idx)
+		link = &m_packed_chunks[*link].next;
+	*link = packed->next;
+
+	packed->chunk_id.id = INVALID_CACHE_CHUNK;
+}
+
+/** Returns false if it couldn't be saved, it stays modified then */
+static bool save_packed_chunk(PackedChunk *packed) {
+	unpack_chunk(packed_data(packed), packed->size, m_unpack_buffer);
+	if (!save_chunk_to_disk(packed->chunk_id, m_unpack_buffer))
+		return false;
+
+	packed->chunk_id.modified = 0;
+	++m_cache_stats.writes;
+	return true;
+}
+
+/** Drops the oldest packed chunk out of the cache, saving it if modified */
+static void drop_packed_chunk() {
+	PackedChunk *packed = &m_packed_chunks[m_packed_first];
+	m_packed_first		= (m_packed_first + 1) % m_packed_size;
+	--m_packed_count;
+
+	if (packed->chunk_id.id == INVALID_CACHE_CHUNK)
+		return;
+
+	/* The log needs its room, the chunk can't wait for the disk anymore */
+	if (packed->chunk_id.modified && !save_packed_chunk(packed))
+		logerr("drop_packed_chunk: Chunk %u,%u couldn't be saved, its changes "
+			   "are lost",
+			   packed->chunk_id.x, packed->chunk_id.y);
+	unlink_packed_chunk(packed);
+	++m_cache_stats.evictions;
+}
+
+/** Appends the chunk in m_pack_buffer to the log, dropping the oldest ones
+ * until it fits */
+static void push_packed_chunk(Chunk chunk_id, const size_t size) {
+	/* Packed chunks never wrap around the end of the log */
+	size_t offset = m_packed_head;
+	if (offset % m_packed_log_size + size > m_packed_log_size)
+		offset = (offset / m_packed_log_size + 1) * m_packed_log_size;
+
+	while (m_packed_count == m_packed_size ||
+		   (m_packed_count > 0 &&
+			offset + size - m_packed_chunks[m_packed_first].offset >
+				m_packed_log_size))
+		drop_packed_chunk();
+
+	const uint32_t idx =
+		(m_packed_first + m_packed_count++) % m_packed_size;
+	PackedChunk *packed = &m_packed_chunks[idx];
+	packed->chunk_id	= chunk_id;
+	packed->size		= size;
+	packed->offset		= offset;
+	memcpy(&m_packed_log[offset % m_packed_log_size], m_pack_buffer, size);
+	m_packed_head = offset + size;
+
+	const size_t bucket		 = cache_bucket(chunk_id, m_packed_bits);
+	packed->next			 = m_packed_buckets[bucket];
+	m_packed_buckets[bucket] = idx;
+}
+
+/** Moves the clock hand past the entries used since its last turn, and
+ * returns the first one that wasn't, out of its bucket. Its chunk is left
+ * packed in m_pack_buffer, for push_packed_chunk once the caller is done. */
+static CacheChunk *evict_cached_chunk(Chunk *evicted, size_t *packed_size) {
+	for (;;) {
+		const uint32_t idx	  = m_cache_hand;
+		CacheChunk	  *cached = &m_cached_chunks[idx];
+
+		m_cache_hand = (m_cache_hand + 1) % m_cache_size;
+
+		evicted->id = cached->chunk_id.id;
+		if (cached->chunk_id.id == INVALID_CACHE_CHUNK) {
+			++m_cache_stats.used;
+			return cached;
 		}
+
+		if (cached->referenced) {
+			cached->referenced = false;
+			continue;
+		}
+
+		*packed_size = pack_chunk(cached->chunk_data, m_pack_buffer);
+
+		uint32_t *link =
+			&m_cache_buckets[cache_bucket(cached->chunk_id, m_cache_bits)];
+		while (*link != idx)
+			link = &m_cached_chunks[*link].next;
+		*link = cached->next;
+
+		return cached;
 	}
+}
+
+/** Puts a hot entry in the bucket of its chunk */
+static void link_cached_chunk(CacheChunk *cached) {
+	const size_t bucket		= cache_bucket(cached->chunk_id, m_cache_bits);
+	cached->next			= m_cache_buckets[bucket];
+	m_cache_buckets[bucket] = cached - m_cached_chunks;
+}
 
-	/* Save to disk the previous cached chunk data */
-	if (cache_chunk->chunk_id.id != INVALID_CACHE_CHUNK) {
-		save_chunk_to_disk(cache_chunk->chunk_id, cache_chunk->chunk_data);
+/** Maps size bytes of anonymous memory, on huge pages if asked and there are
+ * any reserved, else hinting the kernel to back it with them */
+static void *map_arena(const size_t size, const bool huge_pages) {
+#ifdef _WIN32
+	(void)huge_pages;
+	return malloc(size);
+#else
+	void *arena = MAP_FAILED;
+#ifdef MAP_HUGETLB
+	if (huge_pages)
+		arena = mmap(NULL,
+					 GRIDALIGN((size + CHUNK_CACHE_HUGE_PAGE - 1),
+							   CHUNK_CACHE_HUGE_PAGE),
+					 PROT_READ | PROT_WRITE,
+					 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+	if (arena == MAP_FAILED) {
+		arena = mmap(NULL, size, PROT_READ | PROT_WRITE,
+					 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (arena == MAP_FAILED)
+			return NULL;
+#ifdef MADV_HUGEPAGE
+		if (huge_pages)
+			madvise(arena, size, MADV_HUGEPAGE);
+#endif
+	}
+	return arena;
+#endif
+}
+
+void cache_chunk_init(const size_t budget_mb, const bool huge_pages) {
+	const size_t budget = budget_mb << 20;
+
+	/* A share of the budget goes to the hot tier, the rest to the log */
+	const size_t hot_budget = budget / CHUNK_CACHE_HOT_SHARE;
+	m_cache_size = clamp_low(hot_budget / sizeof(CacheChunk),
+							 CHUNK_CACHE_MIN_ENTRIES);
+
+	const size_t hot_size = m_cache_size * sizeof(CacheChunk);
+	m_packed_log_size =
+		clamp_low(budget - clamp_high(hot_size, budget), CHUNK_CACHE_MIN_LOG);
+	m_packed_size =
+		clamp_low(m_packed_log_size / CHUNK_CACHE_PACKED_AVG,
+				  CHUNK_CACHE_MIN_ENTRIES);
+	m_cache_bits  = cache_bucket_bits(m_cache_size);
+	m_packed_bits = cache_bucket_bits(m_packed_size);
+
+	const size_t hot_entries_size = CHUNK_CACHE_ALIGN(hot_size);
+	const size_t hot_buckets_size =
+		CHUNK_CACHE_ALIGN(((size_t)1 << m_cache_bits) * sizeof(uint32_t));
+	const size_t cold_size =
+		CHUNK_CACHE_ALIGN(m_packed_size * sizeof(PackedChunk));
+	const size_t cold_buckets_size =
+		CHUNK_CACHE_ALIGN(((size_t)1 << m_packed_bits) * sizeof(uint32_t));
+
+	uint8_t *arena = map_arena(hot_entries_size + hot_buckets_size + cold_size +
+								   cold_buckets_size + m_packed_log_size,
+							   huge_pages);
+	if (arena == NULL) {
+		logerr("cache_chunk_init: Can't allocate %zu MB of chunk cache",
+			   budget_mb);
+		exit(1);
+	}
+	m_cached_chunks	 = (CacheChunk *)arena;
+	m_cache_buckets	 = (uint32_t *)(arena += hot_entries_size);
+	m_packed_chunks	 = (PackedChunk *)(arena += hot_buckets_size);
+	m_packed_buckets = (uint32_t *)(arena += cold_size);
+	m_packed_log	 = arena + cold_buckets_size;
+
+	for (size_t i = 0; i < m_cache_size; ++i) {
+		m_cached_chunks[i].chunk_id.id = INVALID_CACHE_CHUNK;
+		m_cached_chunks[i].referenced  = false;
+	}
+	memset(m_cache_buckets, 0xFF, hot_buckets_size);
+	memset(m_packed_buckets, 0xFF, cold_buckets_size);
+	m_cache_hand   = 0;
+	m_packed_first = 0;
+	m_packed_count = 0;
+	m_packed_head  = 0;
+
+	memset(&m_cache_stats, 0, sizeof(m_cache_stats));
+	m_cache_stats.entries = m_cache_size;
+}
+
+bool cache_chunk_flushall() {
+	bool saved = true;
+
+	for (size_t i = 0; i < m_cache_size; ++i) {
+		CacheChunk *cached = &m_cached_chunks[i];
+		if (cached->chunk_id.id != INVALID_CACHE_CHUNK &&
+			cached->chunk_id.modified) {
+			if (!save_chunk_to_disk(cached->chunk_id, cached->chunk_data)) {
+				saved = false;
+				continue;
+			}
+			cached->chunk_id.modified = 0;
+			++m_cache_stats.writes;
+		}
+	}
+
+	for (size_t k = 0; k < m_packed_count; ++k) {
+		PackedChunk *packed =
+			&m_packed_chunks[(m_packed_first + k) % m_packed_size];
+		if (packed->chunk_id.id != INVALID_CACHE_CHUNK &&
+			packed->chunk_id.modified)
+			saved &= save_packed_chunk(packed);
+	}
+
+	return saved;
+}
+
+void cache_chunk_writeback() {
+	if (m_packed_count == 0)
+		return;
+
+	/* Nothing to do until the log is about to drop chunks */
+	const size_t log_used =
+		m_packed_head - m_packed_chunks[m_packed_first].offset;
+	if (log_used + CHUNK_CACHE_WRITEBACK * CHUNK_MEMSIZE <= m_packed_log_size &&
+		m_packed_count + CHUNK_CACHE_WRITEBACK <= m_packed_size)
+		return;
+
+	for (size_t k = 0; k < m_packed_count && k < CHUNK_CACHE_WRITEBACK; ++k) {
+		PackedChunk *packed =
+			&m_packed_chunks[(m_packed_first + k) % m_packed_size];
+		/* If it fails, it stays modified for the next frame */
+		if (packed->chunk_id.id != INVALID_CACHE_CHUNK &&
+			packed->chunk_id.modified) {
+			save_packed_chunk(packed);
+			return;
+		}
+	}
+}
+
+void cache_chunk(Chunk chunk_id, const size_t vy, const size_t vx) {
+	CacheChunk *cache_chunk = find_cached_chunk(chunk_id);
+
+	if (cache_chunk != NULL) {
+		/* Newer data of the same chunk, still to be saved if the older was */
+		chunk_id.modified |= cache_chunk->chunk_id.modified;
+	} else {
+		/* An older packed copy must not outlive this one */
+		PackedChunk *packed = find_packed_chunk(chunk_id);
+		if (packed != NULL) {
+			chunk_id.modified |= packed->chunk_id.modified;
+			unlink_packed_chunk(packed);
+		}
+
+		Chunk  evicted;
+		size_t packed_size;
+		cache_chunk = evict_cached_chunk(&evicted, &packed_size);
+		if (evicted.id != INVALID_CACHE_CHUNK)
+			push_packed_chunk(evicted, packed_size);
+
+		cache_chunk->chunk_id = chunk_id;
+		link_cached_chunk(cache_chunk);
 	}
 
 	/* Update cached chunk with new data line by line */
-	cache_chunk->chunk_id = chunk_id;
+	cache_chunk->chunk_id	= chunk_id;
+	cache_chunk->referenced = true;
 	for (size_t k = 0; k < CHUNK_SIZE; ++k) {
 		/* Sanitize flags before copying */
+		GO_ID *row = &GAMEBOARD(vx, vy + k);
 		for (size_t l = 0; l < CHUNK_SIZE; ++l)
-			gameboard[vy + k][vx + l].updated = 0;
+			row[l].updated = 0;
 
-		memcpy(cache_chunk->chunk_data + (k * CHUNK_SIZE),
-			   &gameboard[vy + k][vx], CHUNK_SIZE);
+		memcpy(cache_chunk->chunk_data + (k * CHUNK_SIZE), row, CHUNK_SIZE);
 	}
+}
 
-	/* Update index if it's a new cache chunk */
-	if (cache_chunk == &m_cached_chunks[m_cc_idx]) {
-		if (++m_cc_idx == CHUNK_CACHE_SIZE)
-			m_cc_idx = 0;
+bool cache_has_chunk(Chunk chunk_id) {
+	CacheChunk *cached = find_cached_chunk(chunk_id);
+	if (cached != NULL) {
+		cached->referenced = true;
+		return true;
 	}
+
+	return find_packed_chunk(chunk_id) != NULL;
 }
 
 GO_ID *cache_get_chunk(Chunk chunk_id) {
-	/* If cache is not full, iterate until m_cc_idx */
-	const uint_fast8_t max_cache_idx =
-		(m_cached_chunks[CHUNK_CACHE_SIZE_M1].chunk_id.id ==
-		 INVALID_CACHE_CHUNK)
-			? m_cc_idx
-			: CHUNK_CACHE_SIZE;
+	CacheChunk *cached = find_cached_chunk(chunk_id);
+	if (cached != NULL) {
+		cached->referenced = true;
+		return cached->chunk_data;
+	}
 
-	for (size_t i = 0; i < max_cache_idx; ++i) {
-		if (CHUNK_ID(m_cached_chunks[i].chunk_id) == CHUNK_ID(chunk_id)) {
-			return m_cached_chunks[i].chunk_data;
-		}
+	PackedChunk *packed = find_packed_chunk(chunk_id);
+	if (packed == NULL)
+		return NULL;
+
+	/* Back to the hot tier, before the log makes room for the chunk it
+	 * replaces */
+	Chunk  evicted;
+	size_t packed_size;
+	cached = evict_cached_chunk(&evicted, &packed_size);
+	unpack_chunk(packed_data(packed), packed->size, cached->chunk_data);
+	cached->chunk_id   = packed->chunk_id;
+	cached->referenced = true;
+	unlink_packed_chunk(packed);
+	link_cached_chunk(cached);
+
+	if (evicted.id != INVALID_CACHE_CHUNK)
+		push_packed_chunk(evicted, packed_size);
+
+	++m_cache_stats.unpacks;
+	return cached->chunk_data;
+}
+
+void cache_chunk_stats(CacheStats *stats) {
+	*stats		 = m_cache_stats;
+	stats->dirty = 0;
+	for (size_t i = 0; i < m_cache_size; ++i) {
+		const Chunk cid = m_cached_chunks[i].chunk_id;
+		if (cid.id != INVALID_CACHE_CHUNK && cid.modified)
+			++stats->dirty;
+	}
+
+	stats->packed		= 0;
+	stats->packed_bytes = 0;
+	for (size_t k = 0; k < m_packed_count; ++k) {
+		const PackedChunk *packed =
+			&m_packed_chunks[(m_packed_first + k) % m_packed_size];
+		if (packed->chunk_id.id == INVALID_CACHE_CHUNK)
+			continue;
+
+		++stats->packed;
+		stats->packed_bytes += packed->size;
+		if (packed->chunk_id.modified)
+			++stats->dirty;
+	}
+}
+
+static StageChunk m_staged_chunks[CHUNK_STAGE_SLOTS];
+
+/* Chunks loaded without being staged are made ready here */
+static StageChunk m_loading_chunk;
+
+/* Slot states and priorities are shared with the workers under m_stage_lock.
+ * The data of a slot belongs to whoever set it STAGE_WORKING. */
+static SDL_mutex  *m_stage_lock;
+static SDL_cond	  *m_stage_queued; /* Signaled when there is work */
+static SDL_cond	  *m_stage_done;   /* Signaled when a chunk is ready */
+static SDL_Thread *m_stage_workers[CHUNK_STAGE_MAX_WORKERS];
+static size_t	   m_stage_worker_count;
+static bool		   m_stage_quit;
+
+static StageChunk *find_staged_chunk(Chunk chunk_id) {
+	for (size_t i = 0; i < CHUNK_STAGE_SLOTS; ++i) {
+		StageChunk *staged = &m_staged_chunks[i];
+		if (staged->state != STAGE_FREE &&
+			CHUNK_ID(staged->chunk_id) == CHUNK_ID(chunk_id))
+			return staged;
 	}
 
 	return NULL;
 }
 
-bool update_object(const size_t x, const size_t y, const bool ltr) {
-	size_t left_or_right = (ltr ? 1 : -1);
+/** Returns the most urgent wanted chunk waiting to be generated, or NULL */
+static StageChunk *next_queued_chunk() {
+	StageChunk *next = NULL;
+	for (size_t i = 0; i < CHUNK_STAGE_SLOTS; ++i) {
+		StageChunk *staged = &m_staged_chunks[i];
+		if (staged->state == STAGE_QUEUED &&
+			staged->priority != CHUNK_STAGE_UNWANTED &&
+			(next == NULL || staged->priority < next->priority))
+			next = staged;
+	}
 
-	size_t up_y		= y - 1;
-	size_t down_y	= y + 1;
-	size_t left_x	= x - left_or_right;
-	size_t left_x2	= x - left_or_right - left_or_right;
-	size_t right_x	= x + left_or_right;
-	size_t right_x2 = x + left_or_right + left_or_right;
+	return next;
+}
 
-	GO_ID *boardxy = &gameboard[y][x];
-	GO_ID *bottom  = &gameboard[down_y][x];
+static int stage_worker(void *data) {
+	(void)data;
 
-	GO_ID		gobjr = *boardxy;
-	GameObject *gobj  = &GOBJECT(gobjr);
-	GO_Type		type  = gobj->type;
+	SDL_LockMutex(m_stage_lock);
+	while (!m_stage_quit) {
+		StageChunk *staged = next_queued_chunk();
+		if (staged == NULL) {
+			SDL_CondWait(m_stage_queued, m_stage_lock);
+			continue;
+		}
 
-	switch (type) {
-	case GO_POWDER: {
-		GO_ID *bottomleft  = &gameboard[down_y][left_x];
-		GO_ID *bottomright = &gameboard[down_y][right_x];
+		staged->state = STAGE_WORKING;
+		SDL_UnlockMutex(m_stage_lock);
 
-		if (IS_IN_BOUNDS(x, down_y)) {
-			if ((*bottom).raw == GO_NONE.raw) {
-				(*bottom).id	  = gobjr.id;
-				(*bottom).updated = 1;
-				(*boardxy).raw	  = GO_NONE.raw;
-				subchunk_set_world(x, down_y);
-				subchunk_set_world(x, y);
-				return true;
-			}
+		generate_chunk(WORLD_SEED, staged->chunk_id, staged->chunk_data,
+					   staged->rows, CHUNK_SIZE);
 
-			if (IS_IN_BOUNDS_H(left_x) && (*bottomleft).raw == GO_NONE.raw) {
-				(*bottomleft).id	  = gobjr.id;
-				(*bottomleft).updated = 1;
-				(*boardxy).raw		  = GO_NONE.raw;
-				subchunk_set_world(left_x, down_y);
-				subchunk_set_world(x, y);
-				return true;
-			}
+		SDL_LockMutex(m_stage_lock);
+		staged->rows  = CHUNK_SIZE;
+		staged->state = STAGE_READY;
+		SDL_CondBroadcast(m_stage_done);
+	}
+	SDL_UnlockMutex(m_stage_lock);
 
-			if (IS_IN_BOUNDS_H(right_x) && (*bottomright).raw == GO_NONE.raw) {
-				(*bottomright).id	   = gobjr.id;
-				(*bottomright).updated = 1;
-				(*boardxy).raw		   = GO_NONE.raw;
-				subchunk_set_world(right_x, down_y);
-				subchunk_set_world(x, y);
-				return true;
-			}
-		}
-	} break;
-	case GO_LIQUID: {
-		GO_ID *bottomleft  = &gameboard[down_y][left_x];
-		GO_ID *bottomright = &gameboard[down_y][right_x];
-		GO_ID *left		   = &gameboard[y][left_x];
-		GO_ID *right	   = &gameboard[y][right_x];
-
-		if (IS_IN_BOUNDS_V(down_y) && (*bottom).raw == GO_NONE.raw) {
-			(*bottom).id	  = gobjr.id;
-			(*bottom).updated = 1;
-			(*boardxy).raw	  = GO_NONE.raw;
-			subchunk_set_world(x, down_y);
-			subchunk_set_world(x, y);
-			return true;
-		}
-
-		if (IS_IN_BOUNDS_H(left_x)) {
-			/* If there is a blocking fluid try to move it when its density
-			 * is lower, this makes the water look more fluent */
-			if (IS_IN_BOUNDS_H(left_x2) && (*left).raw == gobjr.raw &&
-				(gameboard[y][left_x2]).raw < gobjr.raw) {
-				if (update_object(left_x2, y, ltr))
-					update_object(left_x, y, ltr);
-			}
+	return 0;
+}
 
-			if ((*left).raw == GO_NONE.raw) {
-				(*left).id		= gobjr.id;
-				(*left).updated = 1;
-				(*boardxy).raw	= GO_NONE.raw;
-				subchunk_set_world(left_x, y);
-				subchunk_set_world(x, y);
-				return true;
-			}
+void chunk_stage_init(size_t workers) {
+	for (size_t i = 0; i < CHUNK_STAGE_SLOTS; ++i)
+		m_staged_chunks[i].state = STAGE_FREE;
+
+	m_stage_lock   = SDL_CreateMutex();
+	m_stage_queued = SDL_CreateCond();
+	m_stage_done   = SDL_CreateCond();
+	m_stage_quit   = false;
+
+	/* Without workers, chunk_stage_step generates them itself */
+	workers				 = clamp_high(workers, CHUNK_STAGE_MAX_WORKERS);
+	m_stage_worker_count = 0;
+	for (size_t k = 0; k < workers; ++k) {
+		SDL_Thread *worker = SDL_CreateThread(stage_worker, "stage", NULL);
+		if (worker == NULL)
+			break;
+		m_stage_workers[m_stage_worker_count++] = worker;
+	}
+}
+
+void chunk_stage_quit() {
+	SDL_LockMutex(m_stage_lock);
+	m_stage_quit = true;
+	SDL_CondBroadcast(m_stage_queued);
+	SDL_UnlockMutex(m_stage_lock);
+
+	for (size_t k = 0; k < m_stage_worker_count; ++k)
+		SDL_WaitThread(m_stage_workers[k], NULL);
+	m_stage_worker_count = 0;
+
+	SDL_DestroyCond(m_stage_done);
+	SDL_DestroyCond(m_stage_queued);
+	SDL_DestroyMutex(m_stage_lock);
+}
+
+void chunk_stage_want(const Chunk *chunks, const size_t count) {
+	SDL_LockMutex(m_stage_lock);
+
+	for (size_t i = 0; i < CHUNK_STAGE_SLOTS; ++i)
+		m_staged_chunks[i].priority = CHUNK_STAGE_UNWANTED;
+
+	/* Keep the progress of the chunks already staged before giving their
+	 * slots away */
+	for (size_t k = 0; k < count; ++k) {
+		StageChunk *staged = find_staged_chunk(chunks[k]);
+		if (staged != NULL)
+			staged->priority = k;
+	}
+
+	for (size_t k = 0; k < count; ++k) {
+		/* Already staged, or cached and quick enough to copy in as it is */
+		if (find_staged_chunk(chunks[k]) != NULL || cache_has_chunk(chunks[k]))
+			continue;
+
+		/* Prefer empty slots, then the ones no longer wanted. A chunk that is
+		 * being generated keeps its slot until it's done. */
+		StageChunk *staged = NULL;
+		for (size_t i = 0; i < CHUNK_STAGE_SLOTS && staged == NULL; ++i) {
+			if (m_staged_chunks[i].state == STAGE_FREE)
+				staged = &m_staged_chunks[i];
+		}
+		for (size_t i = 0; i < CHUNK_STAGE_SLOTS && staged == NULL; ++i) {
+			if (m_staged_chunks[i].priority == CHUNK_STAGE_UNWANTED &&
+				m_staged_chunks[i].state != STAGE_WORKING)
+				staged = &m_staged_chunks[i];
 		}
+		if (staged == NULL)
+			break;
 
-		if (IS_IN_BOUNDS_H(right_x)) {
-			/* If there is a blocking fluid try to move it when its density
-			 * is lower, this makes the water look more fluent */
-			if (IS_IN_BOUNDS_H(right_x2) && (*right).raw == gobjr.raw &&
-				(gameboard[y][right_x2]).raw < gobjr.raw) {
-				if (update_object(right_x2, y, ltr))
-					update_object(right_x, y, ltr);
-			}
+		staged->chunk_id		  = chunks[k];
+		staged->chunk_id.modified = 0;
+		staged->state			  = STAGE_PENDING;
+		staged->priority		  = k;
+		staged->rows			  = 0;
+	}
 
-			if ((*right).raw == GO_NONE.raw) {
-				(*right).id		 = gobjr.id;
-				(*right).updated = 1;
-				(*boardxy).raw	 = GO_NONE.raw;
-				subchunk_set_world(right_x, y);
-				subchunk_set_world(x, y);
-				return true;
-			}
+	SDL_UnlockMutex(m_stage_lock);
+}
+
+void chunk_stage_step(const size_t budget_us) {
+	const Uint64 start = SDL_GetPerformanceCounter();
+	const Uint64 budget =
+		SDL_GetPerformanceFrequency() * budget_us / 1000000;
+
+	SDL_LockMutex(m_stage_lock);
+
+	/* Saved chunks are read here, the disk is not for the workers */
+	for (size_t i = 0; i < CHUNK_STAGE_SLOTS; ++i) {
+		StageChunk *staged = &m_staged_chunks[i];
+		if (staged->state != STAGE_PENDING ||
+			staged->priority == CHUNK_STAGE_UNWANTED)
+			continue;
+		if (SDL_GetPerformanceCounter() - start >= budget)
+			break;
+
+		/* Pending chunks are only touched by this thread */
+		SDL_UnlockMutex(m_stage_lock);
+		const bool saved =
+			load_chunk_from_disk(staged->chunk_id, staged->chunk_data);
+		SDL_LockMutex(m_stage_lock);
+
+		staged->rows  = saved ? CHUNK_SIZE : 0;
+		staged->state = saved ? STAGE_READY : STAGE_QUEUED;
+	}
+
+	if (m_stage_worker_count > 0) {
+		SDL_CondBroadcast(m_stage_queued);
+		SDL_UnlockMutex(m_stage_lock);
+		return;
+	}
+
+	/* No workers, generate them a few rows at a time */
+	StageChunk *staged = next_queued_chunk();
+	while (staged != NULL && SDL_GetPerformanceCounter() - start < budget) {
+		const size_t rows =
+			clamp_high(staged->rows + CHUNK_STAGE_ROWS, CHUNK_SIZE);
+		generate_chunk(WORLD_SEED, staged->chunk_id, staged->chunk_data,
+					   staged->rows, rows);
+		staged->rows = rows;
+
+		if (rows == CHUNK_SIZE) {
+			staged->state = STAGE_READY;
+			staged		  = next_queued_chunk();
 		}
+	}
 
-		if (IS_IN_BOUNDS(left_x, down_y) && (*bottomleft).raw == GO_NONE.raw) {
-			(*bottomleft).id	  = gobjr.id;
-			(*bottomleft).updated = 1;
-			(*boardxy).raw		  = GO_NONE.raw;
-			subchunk_set_world(left_x, down_y);
-			subchunk_set_world(x, y);
-			return true;
-		}
-
-		if (IS_IN_BOUNDS(right_x, down_y) &&
-			(*bottomright).raw == GO_NONE.raw) {
-			(*bottomright).id	   = gobjr.id;
-			(*bottomright).updated = 1;
-			(*boardxy).raw		   = GO_NONE.raw;
-			subchunk_set_world(right_x, down_y);
-			subchunk_set_world(x, y);
-			return true;
-		}
-	} break;
-	case GO_GAS: {
-		GO_ID *up	   = &gameboard[up_y][x];
-		GO_ID *upleft  = &gameboard[up_y][left_x];
-		GO_ID *upright = &gameboard[up_y][right_x];
-		GO_ID *left	   = &gameboard[y][left_x];
-		GO_ID *right   = &gameboard[y][right_x];
-
-		if (IS_IN_BOUNDS_V(up_y) && (*up).raw == GO_NONE.raw) {
-			(*up).id	   = gobjr.id;
-			(*up).updated  = 1;
-			(*boardxy).raw = GO_NONE.raw;
-			subchunk_set_world(x, up_y);
-			subchunk_set_world(x, y);
-			return true;
-		}
-
-		if (IS_IN_BOUNDS_H(left_x)) {
-			/* If there is a blocking fluid try to move it when its density
-			 * is lower, this makes the water look more fluent */
-			if (IS_IN_BOUNDS_H(left_x2) && (*left).raw == gobjr.raw &&
-				(gameboard[y][left_x2]).raw < gobjr.raw) {
-				if (update_object(left_x2, y, ltr))
-					update_object(left_x, y, ltr);
-			}
+	SDL_UnlockMutex(m_stage_lock);
+}
 
-			if ((*left).raw == GO_NONE.raw) {
-				(*left).id		= gobjr.id;
-				(*left).updated = 1;
-				(*boardxy).raw	= GO_NONE.raw;
-				subchunk_set_world(left_x, y);
-				subchunk_set_world(x, y);
-				return true;
-			}
+void load_chunk(Chunk chunk_id, const size_t vx, const size_t vy) {
+	const GO_ID *chunk_data = cache_get_chunk(chunk_id);
+	StageChunk	*staged		= NULL;
+
+	if (chunk_data != NULL)
+		++m_cache_stats.hits;
+	else
+		++m_cache_stats.misses;
+
+	if (chunk_data == NULL) {
+		SDL_LockMutex(m_stage_lock);
+
+		/* A worker already started it, waiting is quicker than starting over */
+		staged = find_staged_chunk(chunk_id);
+		while (staged != NULL && staged->state == STAGE_WORKING)
+			SDL_CondWait(m_stage_done, m_stage_lock);
+
+		if (staged == NULL) {
+			staged			 = &m_loading_chunk;
+			staged->chunk_id = chunk_id;
+			staged->state	 = STAGE_PENDING;
+			staged->rows	 = 0;
 		}
 
-		if (IS_IN_BOUNDS_H(right_x)) {
-			/* If there is a blocking fluid try to move it when its density
-			 * is lower, this makes the water look more fluent */
-			if (IS_IN_BOUNDS_H(right_x2) && (*right).raw == gobjr.raw &&
-				(gameboard[y][right_x2]).raw < gobjr.raw) {
-				if (update_object(right_x2, y, ltr))
-					update_object(right_x, y, ltr);
-			}
+		/* Keep the workers off it while finishing what they couldn't */
+		const StageState state = staged->state;
+		staged->state		   = STAGE_WORKING;
+		SDL_UnlockMutex(m_stage_lock);
+
+		if (state == STAGE_PENDING &&
+			load_chunk_from_disk(chunk_id, staged->chunk_data))
+			staged->rows = CHUNK_SIZE;
+		if (staged->rows < CHUNK_SIZE)
+			generate_chunk(WORLD_SEED, chunk_id, staged->chunk_data,
+						   staged->rows, CHUNK_SIZE);
+
+		chunk_data = staged->chunk_data;
+	}
+
+	for (size_t k = 0; k < CHUNK_SIZE; ++k)
+		memcpy(&GAMEBOARD(vx, vy + k), chunk_data + (k * CHUNK_SIZE),
+			   CHUNK_SIZE);
+
+	gameboard_chunk_loaded(vx, vy);
+
+	/* The gameboard has it now, the slot can be given away */
+	if (staged != NULL) {
+		SDL_LockMutex(m_stage_lock);
+		staged->state = STAGE_FREE;
+		SDL_UnlockMutex(m_stage_lock);
+	}
+}
+
+/**
+ * Parity of the current frame. An object moved in this frame when its updated
+ * bit matches it, so the flags of the previous frame expire on their own when
+ * it flips, instead of clearing them in another pass over the gameboard.
+ */
+static bit m_parity = 1;
+
+#define GO_IS_UPDATED(_go) ((_go).updated == m_parity)
+
+/**
+ * Cells that changed during the frames of each parity. Their neighbours are
+ * woken up when the sweep reaches them, in the same frame and in the next one,
+ * so moves set a single bit instead of the whole neighbourhood in the awakemap.
+ */
+static movemap_t m_changemap[2][VSCREEN_HEIGHT][MOVEMAP_WIDTH];
+
+/* Blocks of SUBCHUNK_HEIGHT rows of the ring with bits in each changemap, so
+ * clearing skips the rest. Rows of the ring and not of the view, so they are
+ * still right after the view scrolls. */
+static subchunk_t m_changemap_rows[2];
+
+/** Mark the change of the cell (gx, gy) of the ring */
+static inline void changemap_set(const size_t gx, const size_t gy) {
+	subchunk_t	*rows = &m_changemap_rows[m_parity];
+	const size_t bj	  = gy / SUBCHUNK_HEIGHT;
+	if (!(*rows & BIT(bj)))
+		__atomic_or_fetch(rows, BIT(bj), __ATOMIC_RELAXED);
+
+	/* Plain read-modify-write, like movemap_set() */
+	m_changemap[m_parity][gy][gx / MOVEMAP_BITS] |= MOVEMAP_BIT(gx);
+}
+
+static inline movemap_t changemap_load(const size_t gy, const size_t gw) {
+	return __atomic_load_n(&m_changemap[0][gy][gw], __ATOMIC_RELAXED) |
+		   __atomic_load_n(&m_changemap[1][gy][gw], __ATOMIC_RELAXED);
+}
+
+/** Cells of the word w of row j next to a change, of this frame or the last */
+static inline movemap_t changemap_near(const ssize_t j, const ssize_t w) {
+	const ssize_t j0 = (j > 0) ? j - 1 : 0;
+	const ssize_t j1 = clamp_high(j + 1, VSCREEN_HEIGHT_M1);
+
+	/* Words of the ring, the ones on the sides may be anywhere */
+	const size_t gw = GB_W(w);
+	const size_t gl = (w > 0) ? GB_W(w - 1) : 0;
+	const size_t gr = (w < (ssize_t)MOVEMAP_WIDTH - 1) ? GB_W(w + 1) : 0;
+
+	movemap_t c = 0, l = 0, r = 0;
+	for (ssize_t k = j0; k <= j1; ++k) {
+		const size_t gk = GB_Y(k);
+		c |= changemap_load(gk, gw);
+		if (w > 0)
+			l |= changemap_load(gk, gl);
+		if (w < (ssize_t)MOVEMAP_WIDTH - 1)
+			r |= changemap_load(gk, gr);
+	}
+	return c | (c << 1) | (c >> 1) | (l >> (MOVEMAP_BITS - 1)) |
+		   (r << (MOVEMAP_BITS - 1));
+}
+
+/** Forget the changes of the frames with parity p */
+static void changemap_clear(const bit p) {
+	for (size_t sj = 0; sj < SUBCHUNK_SIZE; ++sj) {
+		if (m_changemap_rows[p] & BIT(sj))
+			memset(m_changemap[p][sj * SUBCHUNK_HEIGHT], 0,
+				   SUBCHUNK_HEIGHT * sizeof(m_changemap[p][0]));
+	}
+	m_changemap_rows[p] = 0;
+}
+
+static inline void subchunk_mark_rects(const size_t x, const size_t y);
+
+/** The object at (x, y), stored at (gx, gy) of the ring, moved to the empty
+ * cell (to_x, to_y), and it goes on with velocity vel. It keeps resting if it
+ * didn't fall, like when it slides on a flat floor, so it goes to sleep sooner
+ * once it can't move anymore. */
+static inline void mark_moved(const size_t x, const size_t y, const size_t gx,
+							  const size_t gy, const size_t to_x,
+							  const size_t to_y, const uint8_t vel) {
+	const size_t to_gx = GB_X(to_x);
+	const size_t to_gy = GB_Y(to_y);
+
+	GO_State state = gamestate[gy][gx];
+	state.rest	   = (to_y != y) ? 0 : clamp_high(state.rest + 1, GO_REST_TICKS);
+	state.vel	   = vel;
+
+	/* The emptied cell keeps a stale state, whatever fills it overwrites it */
+	gamestate[to_gy][to_gx] = state;
+
+	movemap[gy][gx / MOVEMAP_BITS] &= ~MOVEMAP_BIT(gx);
+	movemap[to_gy][to_gx / MOVEMAP_BITS] |= MOVEMAP_BIT(to_gx);
+	awakemap[to_gy][to_gx / MOVEMAP_BITS] |= MOVEMAP_BIT(to_gx);
+	drawmap_set(gx, gy);
+	drawmap_set(to_gx, to_gy);
+	subchunk_mark_rects(to_x, to_y);
+	subchunk_mark_rects(x, y);
+
+	/* The neighbours of the emptied cell may move into it. When the object
+	 * went up, the one above it may sink now too. */
+	changemap_set(gx, gy);
+	if (to_y < y)
+		changemap_set(to_gx, to_gy);
+}
+
+/** Cell at (x, y), that is step cells away from the cell at from. Stepping
+ * the pointer is only right when inner, away from the seams of the ring. */
+static inline GO_ID *board_step(GO_ID *from, const ssize_t step,
+								const bool inner, const size_t x,
+								const size_t y) {
+	return inner ? from + step : &GAMEBOARD(x, y);
+}
+
+/** Move the object at (x, y), stored at (gx, gy) of the ring, with its rules.
+ * Returns true if it moved. */
+bool update_object(const size_t x, const size_t y, const size_t gx,
+				   const size_t gy, const bool ltr) {
+	const ssize_t left_or_right = (ltr ? 1 : -1);
+
+	GO_ID		   *boardxy = &gameboard[gy][gx];
+	const GO_ID		gobjr	= *boardxy;
+	const GO_Rules *rules	= GO_RULES(gobjr);
+
+	/* Far from the borders there is no need to check the bounds of every
+	 * candidate, not even the farthest one. Far from where the ring wraps
+	 * around, the candidates are plain pointer steps. */
+	const bool inner = (x - GO_MAX_REACH < VSCREEN_WIDTH - 2 * GO_MAX_REACH) &&
+					   (y - GO_MAX_REACH < VSCREEN_HEIGHT - 2 * GO_MAX_REACH) &&
+					   (gx - GO_MAX_REACH < VSCREEN_WIDTH - 2 * GO_MAX_REACH) &&
+					   (gy - GO_MAX_REACH < VSCREEN_HEIGHT - 2 * GO_MAX_REACH);
+
+#pragma GCC unroll 6
+	for (uint_fast8_t k = 0; k < GO_MAX_MOVES; ++k) {
+		if (k == rules->count)
+			break;
+		const GO_Move move = rules->moves[k];
+		const ssize_t dx   = move.dx * left_or_right;
+		size_t		  to_x = x + dx;
+		size_t		  to_y = y + move.dy;
+
+		if (!inner && !IS_IN_BOUNDS(to_x, to_y))
+			continue;
+
+		const ssize_t step	 = move.dy * VSCREEN_WIDTH + dx;
+		GO_ID		 *target = board_step(boardxy, step, inner, to_x, to_y);
+		uint8_t		  vel	 = 0;
+
+		if (move.flags == 0) {
+			if ((*target).raw != GO_NONE.raw)
+				continue;
+		} else if (move.flags & GO_MOVE_FALL) {
+			if ((*target).raw != GO_NONE.raw)
+				continue;
 
-			if ((*right).raw == GO_NONE.raw) {
-				(*right).id		 = gobjr.id;
-				(*right).updated = 1;
-				(*boardxy).raw	 = GO_NONE.raw;
-				subchunk_set_world(right_x, y);
+			/* Keep falling through empty cells as far as the velocity. Gravity
+			 * only speeds it up if nothing stopped it. */
+			const uint8_t reach = 1 + gamestate[gy][gx].vel;
+			uint8_t		  far	= 1;
+			while (far < reach &&
+				   (inner || IS_IN_BOUNDS(to_x + dx, to_y + move.dy))) {
+				GO_ID *next =
+					board_step(target, step, inner, to_x + dx, to_y + move.dy);
+				if ((*next).raw != GO_NONE.raw)
+					break;
+				target = next;
+				to_x += dx;
+				to_y += move.dy;
+				++far;
+			}
+			vel = (far < reach) ? 0 : clamp_high(reach, GO_MAX_VELOCITY);
+		} else if (move.flags & GO_MOVE_SINK) {
+			/* Flow down in less dense fluids */
+			const GO_ID other = *target;
+			if (other.raw && !GO_IS_UPDATED(other) &&
+				GO_IS_FLUID(GO_TYPE(other)) &&
+				GO_DENSITY(other) < GO_DENSITY(gobjr)) {
+				SWAP((*target).raw, (*boardxy).raw);
+				(*target).updated  = m_parity;
+				(*boardxy).updated = m_parity;
+				/* Both fell, one of them upwards, and both slowly */
+				GAMESTATE(to_x, to_y).raw = 0;
+				gamestate[gy][gx].raw	  = 0;
+				awakemap[gy][gx / MOVEMAP_BITS] |= MOVEMAP_BIT(gx);
+				awakemap_set(to_x, to_y);
+				drawmap_set(gx, gy);
+				drawmap_set(GB_X(to_x), GB_Y(to_y));
 				subchunk_set_world(x, y);
+				subchunk_set_world(to_x, to_y);
 				return true;
 			}
+			continue;
+		} else {
+			/* Disperse: flow through the same object up to its reach, and
+			 * take the farthest empty cell on the way */
+			size_t far	= 0;
+			GO_ID *cell = boardxy;
+			for (size_t r = 1; r <= move.reach; ++r) {
+				if (!inner && !IS_IN_BOUNDS(x + r * dx, y + r * move.dy))
+					break;
+				cell = board_step(cell, step, inner, x + r * dx,
+								  y + r * move.dy);
+				if ((*cell).raw == GO_NONE.raw)
+					far = r;
+				else if ((*cell).id != gobjr.id)
+					break;
+			}
+			if (far == 0)
+				continue;
+
+			to_x   = x + far * dx;
+			to_y   = y + far * move.dy;
+			target = board_step(boardxy, far * step, inner, to_x, to_y);
 		}
 
-		if (IS_IN_BOUNDS(left_x, up_y) && (*upleft).raw == GO_NONE.raw) {
-			(*upleft).id	  = gobjr.id;
-			(*upleft).updated = 1;
-			(*boardxy).raw	  = GO_NONE.raw;
-			subchunk_set_world(left_x, up_y);
-			subchunk_set_world(x, y);
-			return true;
-		}
-
-		if (IS_IN_BOUNDS(right_x, up_y) && (*upright).raw == GO_NONE.raw) {
-			(*upright).id	   = gobjr.id;
-			(*upright).updated = 1;
-			(*boardxy).raw	   = GO_NONE.raw;
-			subchunk_set_world(right_x, up_y);
-			subchunk_set_world(x, y);
-			return true;
-		}
-	} break;
-	}
-
-	/* Flow down in less dense fluids */
-	const GO_ID bot		  = *bottom;
-	GameObject *go_bottom = &GOBJECT(bot);
-	if (IS_IN_BOUNDS_V(down_y) && bot.raw && !bot.updated &&
-		GO_IS_FLUID(type) && GO_IS_FLUID(go_bottom->type) &&
-		go_bottom->density < gobj->density) {
-		SWAP((*bottom).raw, (*boardxy).raw);
-		(*bottom).updated  = 1;
-		(*boardxy).updated = 1;
-		subchunk_set_world(x, y);
-		subchunk_set_world(x, down_y);
+		(*target).id	  = gobjr.id;
+		(*target).updated = m_parity;
+		(*boardxy).raw	  = GO_NONE.raw;
+		mark_moved(x, y, gx, gy, to_x, to_y, vel);
 		return true;
 	}
 
@@ -454,12 +1237,269 @@ bool update_object(const size_t x, const size_t y, const bool ltr) {
 
 /* ==== Update gameboard subchunked ==== */
 
-void update_gameboard() {
-	static bool left_to_right = false;
+#ifdef _OPENMP
+bool PARALLEL_UPDATE = true;
+bool PARALLEL_DRAW	 = true;
+#else
+bool PARALLEL_UPDATE = false;
+bool PARALLEL_DRAW	 = false;
+#endif
+
+/* Dirty rects and active subchunks this frame is working on. The live ones are
+ * emptied when the frame starts and they grow with the moves of this frame, so
+ * they end up being the work of the next frame. */
+static SubchunkRect m_frame_rect[SUBCHUNK_SIZE][SUBCHUNK_SIZE];
+static subchunk_t	m_frame_opt[SUBCHUNK_SIZE];
+
+/* World coordinates of the gameboard origin this frame, random numbers are
+ * drawn for world cells so they don't change when the board moves */
+static size_t m_world_x0;
+static size_t m_world_y0;
+
+/** Whether the row j of the subchunk column si goes left to right this frame */
+static inline bool row_ltr(const size_t si, const size_t j) {
+	return cell_rand(WORLD_SEED, sim_tick, m_world_x0 + si * SUBCHUNK_WIDTH,
+					 m_world_y0 + j) &
+		   1;
+}
+
+#define is_frame_subchunk_active(_i, _j)                                       \
+	(0 != ((m_frame_opt[(_j)] | subchunkopt[(_j)]) & BIT(_i)))
+
+static inline SubchunkRect subchunk_rect_union(const SubchunkRect a,
+											   const SubchunkRect b) {
+	return (SubchunkRect){
+		.x0 = clamp_high(a.x0, b.x0),
+		.y0 = clamp_high(a.y0, b.y0),
+		.x1 = clamp_low(a.x1, b.x1),
+		.y1 = clamp_low(a.y1, b.y1),
+	};
+}
+
+/** Rect of a subchunk for this frame, including what grew since it started */
+static inline SubchunkRect frame_rect(const size_t si, const size_t sj) {
+	const SubchunkRect live = {
+		.raw = __atomic_load_n(&subchunk_rect[sj][si].raw, __ATOMIC_RELAXED)};
+	return subchunk_rect_union(m_frame_rect[sj][si], live);
+}
+
+static inline void subchunk_rect_grow(const size_t si, const size_t sj,
+									  const SubchunkRect r) {
+	SubchunkRect *rect = &subchunk_rect[sj][si];
+	SubchunkRect  old  = {.raw = __atomic_load_n(&rect->raw, __ATOMIC_RELAXED)};
+	SubchunkRect  grown;
+
+	/* Rects stop growing very soon, so this is almost always a plain load */
+	do {
+		grown = subchunk_rect_union(old, r);
+		if (grown.raw == old.raw)
+			return;
+	} while (!__atomic_compare_exchange_n(&rect->raw, &old.raw, grown.raw, true,
+										  __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
 
+/** Marking a neighbourhood that lays on more than one subchunk */
+static void __attribute__((noinline)) subchunk_mark_world_split(size_t x,
+																size_t y) {
+	const size_t x0 = (x > 0) ? x - 1 : 0;
+	const size_t y0 = (y > 0) ? y - 1 : 0;
+	const size_t x1 = clamp_high(x + 1, VSCREEN_WIDTH_M1);
+	const size_t y1 = clamp_high(y + 1, VSCREEN_HEIGHT_M1);
+
+	for (size_t sj = y0 / SUBCHUNK_HEIGHT; sj <= y1 / SUBCHUNK_HEIGHT; ++sj) {
+		const size_t top = sj * SUBCHUNK_HEIGHT;
+		for (size_t si = x0 / SUBCHUNK_WIDTH; si <= x1 / SUBCHUNK_WIDTH; ++si) {
+			const size_t left = si * SUBCHUNK_WIDTH;
+
+			const SubchunkRect r = {
+				.x0 = clamp_low(x0, left) - left,
+				.y0 = clamp_low(y0, top) - top,
+				.x1 = clamp_high(x1, left + SUBCHUNK_WIDTH - 1) - left,
+				.y1 = clamp_high(y1, top + SUBCHUNK_HEIGHT - 1) - top,
+			};
+			subchunk_rect_grow(si, sj, r);
+			subchunk_set(si, sj);
+		}
+	}
+}
+
+/** Grow the dirty rects, the same as subchunk_mark_world() without waking up
+ * the cells */
+static inline void subchunk_mark_rects(const size_t x, const size_t y) {
+	const size_t si = x / SUBCHUNK_WIDTH;
+	const size_t sj = y / SUBCHUNK_HEIGHT;
+	const size_t lx = x - si * SUBCHUNK_WIDTH;
+	const size_t ly = y - sj * SUBCHUNK_HEIGHT;
+
+	/* The neighbourhood lays on up to four subchunks */
+	if (lx == 0 || ly == 0 || lx == SUBCHUNK_WIDTH - 1 ||
+		ly == SUBCHUNK_HEIGHT - 1) {
+		subchunk_mark_world_split(x, y);
+		return;
+	}
+
+	/* Most of the times the rect already covers it */
+	const SubchunkRect r = subchunk_rect[sj][si];
+	if (r.x0 < lx && r.y0 < ly && r.x1 > lx && r.y1 > ly)
+		return;
+
+	subchunk_rect_grow(si, sj,
+					   (SubchunkRect){
+						   .x0 = lx - 1,
+						   .y0 = ly - 1,
+						   .x1 = lx + 1,
+						   .y1 = ly + 1,
+					   });
+	subchunk_set(si, sj);
+}
+
+void subchunk_mark_world(size_t x, size_t y) {
+	changemap_set(GB_X(x), GB_Y(y));
+	subchunk_mark_rects(x, y);
+}
+
+/** Keep the cell (x, y) in the dirty rects, without waking its neighbours */
+static inline void subchunk_keep_world(const size_t x, const size_t y) {
+	const size_t si = x / SUBCHUNK_WIDTH;
+	const size_t sj = y / SUBCHUNK_HEIGHT;
+	const size_t lx = x - si * SUBCHUNK_WIDTH;
+	const size_t ly = y - sj * SUBCHUNK_HEIGHT;
+
+	const SubchunkRect r = subchunk_rect[sj][si];
+	if (r.x0 <= lx && r.y0 <= ly && r.x1 >= lx && r.y1 >= ly)
+		return;
+
+	subchunk_rect_grow(si, sj,
+					   (SubchunkRect){
+						   .x0 = lx,
+						   .y0 = ly,
+						   .x1 = lx,
+						   .y1 = ly,
+					   });
+	subchunk_set(si, sj);
+}
+
+/** Clip the bits of the word w to the columns i0 to i1 (inclusive) */
+static inline movemap_t movemap_clip(movemap_t bits, const ssize_t w,
+									 const ssize_t i0, const ssize_t i1) {
+	const ssize_t base = w * MOVEMAP_BITS;
+	if (i0 > base)
+		bits &= ~(movemap_t)0 << (i0 - base);
+	if (i1 < base + (ssize_t)MOVEMAP_BITS - 1)
+		bits &= ~(movemap_t)0 >> (base + MOVEMAP_BITS - 1 - i1);
+	return bits;
+}
+
+/** Movable cells in the word w of a row, only between i0 and i1 (inclusive).
+ * The row is stored in the row gj of the ring, and the word in its word gw. */
+static inline movemap_t movemap_span(const size_t gj, const ssize_t w,
+									 const size_t gw, const ssize_t i0,
+									 const ssize_t i1) {
+	return movemap_clip(__atomic_load_n(&movemap[gj][gw], __ATOMIC_RELAXED), w,
+						i0, i1);
+}
+
+/** Same as movemap_span() for the row j, but only the awake cells and the ones
+ * next to a change */
+static inline movemap_t awake_span(const ssize_t j, const size_t gj,
+								   const ssize_t w, const size_t gw,
+								   const ssize_t i0, const ssize_t i1) {
+	const movemap_t bits  = movemap_span(gj, w, gw, i0, i1);
+	const movemap_t awake =
+		__atomic_load_n(&awakemap[gj][gw], __ATOMIC_RELAXED);
+
+	/* Look for changes around only when some of them sleep */
+	if ((bits & ~awake) == 0)
+		return bits;
+	return bits & (awake | changemap_near(j, w));
+}
+
+#define MOVEMAP_EVENS ((movemap_t)0x5555555555555555)
+#define MOVEMAP_ODDS  ((movemap_t)0xAAAAAAAAAAAAAAAA)
+
+/** Update the cell (i, j), stored at (gi, gj) of the ring */
+static inline void update_cell(const ssize_t i, const ssize_t j,
+							   const size_t gi, const size_t gj,
+							   const bool ltr) {
+	/* Moves of the neighbours may have changed it since the word was read */
+	const GO_ID pixel = gameboard[gj][gi];
+	if (pixel.raw == GO_NONE.raw || GO_IS_UPDATED(pixel))
+		return;
+	if (update_object(i, j, gi, gj, ltr))
+		return;
+
+	/* Go to sleep after a few updates without moving, until something changes
+	 * around. Meanwhile keep it in the work of the next frame. */
+	GO_State *state = &gamestate[gj][gi];
+	if (state->rest < GO_REST_TICKS) {
+		++state->rest;
+		state->vel = 0;
+	}
+
+	if (state->rest >= GO_REST_TICKS)
+		awakemap[gj][gi / MOVEMAP_BITS] &= ~MOVEMAP_BIT(gi);
+	else
+		subchunk_keep_world(i, j);
+}
+
+/** Update the objects of row j between i0 and i1 (inclusive), only the odd or
+ * even columns. Empty and static cells are skipped a whole word at a time. */
+static inline void update_row_span(const ssize_t j, const ssize_t i0,
+								   const ssize_t i1, const bool odds,
+								   const bool left_to_right, const bool ltr) {
+	const movemap_t parity = odds ? MOVEMAP_ODDS : MOVEMAP_EVENS;
+	const ssize_t	w0	   = i0 / MOVEMAP_BITS;
+	const ssize_t	w1	   = i1 / MOVEMAP_BITS;
+	const size_t	gj	   = GB_Y(j);
+
+	if (left_to_right) {
+		for (ssize_t w = w0; w <= w1; ++w) {
+			const size_t gw	  = GB_W(w);
+			movemap_t	 bits = awake_span(j, gj, w, gw, i0, i1) & parity;
+			while (bits) {
+				const ssize_t b = __builtin_ctzll(bits);
+				bits &= bits - 1;
+				update_cell(w * MOVEMAP_BITS + b, j, gw * MOVEMAP_BITS + b, gj,
+							ltr);
+			}
+		}
+	} else {
+		for (ssize_t w = w1; w >= w0; --w) {
+			const size_t gw	  = GB_W(w);
+			movemap_t	 bits = awake_span(j, gj, w, gw, i0, i1) & parity;
+			while (bits) {
+				const ssize_t b = MOVEMAP_BITS - 1 - __builtin_clzll(bits);
+				bits &= ~((movemap_t)1 << b);
+				update_cell(w * MOVEMAP_BITS + b, j, gw * MOVEMAP_BITS + b, gj,
+							ltr);
+			}
+		}
+	}
+}
+
+/** Stamp the objects of row j between i0 and i1 (inclusive) with the parity,
+ * so they don't look moved in the next frame. Only for rows that nothing reads
+ * again in this frame. */
+static inline void settle_row_span(const ssize_t j, const ssize_t i0,
+								   const ssize_t i1) {
+	const size_t gj = GB_Y(j);
+	for (ssize_t w = i0 / MOVEMAP_BITS; w <= i1 / MOVEMAP_BITS; ++w) {
+		/* A word is never split by the ring */
+		const size_t gw	   = GB_W(w);
+		GO_ID		*cells = &gameboard[gj][gw * MOVEMAP_BITS];
+		movemap_t	 bits  = movemap_span(gj, w, gw, i0, i1);
+		while (bits) {
+			const ssize_t b = __builtin_ctzll(bits);
+			bits &= bits - 1;
+			cells[b].updated = m_parity;
+		}
+	}
+}
+
+static void update_gameboard_serial(const bool left_to_right) {
 	for (ssize_t sj = SUBCHUNK_SIZE - 1; sj >= 0; --sj) {
 		/* If the whole line of subchunks is inactive, there's nothing to do */
-		if (subchunkopt[sj] == 0)
+		if ((m_frame_opt[sj] | subchunkopt[sj]) == 0)
 			continue;
 
 		ssize_t start_j = sj * SUBCHUNK_HEIGHT;
@@ -468,158 +1508,288 @@ void update_gameboard() {
 
 		bool odds = sj & 1;
 
-		/* First active subchunk i */
-		ssize_t fsi = -1;
-
 		/* Process subchunks, but like they were a whole block. In effect, when
 		 * reaching the edge of a j loop, don't go back to the same subchunk, go
 		 * to the next and this will be revisited. This is weird to say but
 		 * important to make fluids like water to flow consistently. */
 		for (ssize_t j = end_j - 1; j >= start_j; --j) {
-			bool ltr = fast_rand() & 1;
+			const ssize_t lj = j - start_j;
+
+			/* The same direction each subchunk would take on its own. Whole
+			 * batches, the last one may go past the last subchunk. */
+			uint32_t rnd[GRIDALIGN((SUBCHUNK_SIZE + CELL_RAND_BATCH - 1),
+								   CELL_RAND_BATCH)];
+			for (size_t k = 0; k < SUBCHUNK_SIZE; k += CELL_RAND_BATCH)
+				cell_rand_batch(WORLD_SEED, sim_tick,
+								m_world_x0 + k * SUBCHUNK_WIDTH, SUBCHUNK_WIDTH,
+								m_world_y0 + j, &rnd[k]);
+
 			/* First odds, then evens (or viceversa) */
 			repeat(2) {
-				if (left_to_right) {
-					for (ssize_t si = (fsi == -1) ? 0 : fsi; si < SUBCHUNK_SIZE;
-						 ++si) {
-						/* Skip inactive subchunks */
-						if (!is_subchunk_active(si, sj))
-							continue;
-
-						if (fsi == -1)
-							fsi = si;
-
-						ssize_t start_i = si * SUBCHUNK_WIDTH;
-						ssize_t end_i	= start_i + SUBCHUNK_WIDTH;
-
-						bool p = false;
-						for (ssize_t i = start_i + odds; i < end_i; i += 2) {
-							const GO_ID pixel = gameboard[j][i];
-							if (pixel.raw == GO_NONE.raw || pixel.updated)
-								continue;
-							if (update_object(i, j, ltr))
-								p = true;
-						}
-						/* Activate top subchunk for gravity */
-						if (p) {
-							subchunk_set(si, sj - 1);
-							subchunk_set(si - 1, sj);
-							subchunk_set(si + 1, sj);
-						}
-					}
-				} else {
-					for (ssize_t si = (fsi == -1) ? SUBCHUNK_SIZE - 1 : fsi;
-						 (si >= 0); --si) {
-						/* Skip inactive subchunks */
-						if (!is_subchunk_active(si, sj))
-							continue;
-
-						if (fsi == -1)
-							fsi = si;
-
-						ssize_t start_i = si * SUBCHUNK_WIDTH;
-						ssize_t end_i	= start_i + SUBCHUNK_WIDTH;
-
-						bool p = false;
-						for (ssize_t i = end_i - 1 - odds; i >= start_i;
-							 i -= 2) {
-							const GO_ID pixel = gameboard[j][i];
-							if (pixel.raw == GO_NONE.raw || pixel.updated)
-								continue;
-							if (update_object(i, j, ltr))
-								p = true;
-						}
-						/* Activate top subchunk for gravity */
-						if (p) {
-							subchunk_set(si, sj - 1);
-							subchunk_set(si - 1, sj);
-							subchunk_set(si + 1, sj);
-						}
-					}
+				for (ssize_t k = 0; k < SUBCHUNK_SIZE; ++k) {
+					const ssize_t si =
+						left_to_right ? k : (SUBCHUNK_SIZE - 1 - k);
+
+					/* Skip inactive subchunks, and rows out of its rect */
+					if (!is_frame_subchunk_active(si, sj))
+						continue;
+					const SubchunkRect r = frame_rect(si, sj);
+					if (lj < r.y0 || lj > r.y1)
+						continue;
+
+					const ssize_t start_i = si * SUBCHUNK_WIDTH;
+					update_row_span(j, start_i + r.x0, start_i + r.x1, odds,
+									left_to_right, rnd[si] & 1);
 				}
 
 				/* Alternate odds and evens, no worries since the repeat loop is
 				 * even, odd will result in the same state it started. */
 				odds = !odds;
 			}
+
+			/* The row below is done, the top row of the rects is left for the
+			 * subchunks above */
+			if (j + 1 >= end_j)
+				continue;
+			for (ssize_t si = 0; si < SUBCHUNK_SIZE; ++si) {
+				if (!is_frame_subchunk_active(si, sj))
+					continue;
+				const SubchunkRect r = frame_rect(si, sj);
+				if (lj < r.y0 || lj + 1 > r.y1)
+					continue;
+
+				const ssize_t start_i = si * SUBCHUNK_WIDTH;
+				settle_row_span(j + 1, start_i + r.x0, start_i + r.x1);
+			}
 		}
 	}
+}
+
+/**
+ * Update a single subchunk from bottom to top, on its own. Objects never reach
+ * further than GO_MAX_REACH cells away, so subchunks that are not neighbours
+ * can be updated at the same time.
+ */
+static void update_subchunk(const ssize_t si, const ssize_t sj,
+							const bool left_to_right) {
+	const SubchunkRect r = frame_rect(si, sj);
+	if (subchunk_rect_is_empty(r))
+		return;
+
+	const ssize_t start_i = si * SUBCHUNK_WIDTH;
+	const ssize_t start_j = sj * SUBCHUNK_HEIGHT;
 
-	/* Reset gameobjects updated bit of this frame,
-	 * and select which subchunks will keep alive in the next frame. */
+	bool odds = sj & 1;
+
+	for (ssize_t j = start_j + r.y1; j >= start_j + r.y0; --j) {
+		const bool ltr = row_ltr(si, j);
+		/* First odds, then evens (or viceversa) */
+		repeat(2) {
+			update_row_span(j, start_i + r.x0, start_i + r.x1, odds,
+							left_to_right, ltr);
+			odds = !odds;
+		}
+
+		/* The row below is done */
+		if (j < start_j + r.y1)
+			settle_row_span(j + 1, start_i + r.x0, start_i + r.x1);
+	}
+}
+
+/**
+ * Checkerboard schedule: subchunks are colored by the parity of (si, sj), and
+ * each color is a phase. Subchunks of the same color are a whole subchunk away
+ * from each other, so the workers of a phase never touch the same cells.
+ */
+static void update_gameboard_parallel(const bool left_to_right) {
+#pragma omp parallel
+	for (uint_fast8_t color = 0; color < 4; ++color) {
+		/* Bottom rows first, the same way gravity goes */
+#pragma omp for collapse(2) schedule(dynamic)
+		for (ssize_t sj = SUBCHUNK_SIZE - 1 - (color >> 1); sj >= 0; sj -= 2) {
+			for (ssize_t si = color & 1; si < SUBCHUNK_SIZE; si += 2) {
+				/* Skip inactive subchunks */
+				if (!is_frame_subchunk_active(si, sj))
+					continue;
+
+				update_subchunk(si, sj, left_to_right);
+			}
+		}
+	}
+}
+
+void update_gameboard() {
+	static bool left_to_right = false;
+
+	m_world_x0 = vctable[0][0].x * CHUNK_SIZE;
+	m_world_y0 = vctable[0][0].y * CHUNK_SIZE;
+
+	/* Take the rects grown since the last frame as the work of this one */
+	memcpy(m_frame_rect, subchunk_rect, sizeof(m_frame_rect));
+	memcpy(m_frame_opt, subchunkopt, sizeof(m_frame_opt));
 	for (size_t sj = 0; sj < SUBCHUNK_SIZE; ++sj) {
-		/* If the whole line of subchunks is inactive, there's nothing to do */
-		if (subchunkopt[sj] == 0)
-			continue;
+		subchunkopt[sj] = 0;
+		for (size_t si = 0; si < SUBCHUNK_SIZE; ++si)
+			subchunk_rect[sj][si] = SUBCHUNK_RECT_EMPTY;
+	}
 
-		size_t start_j = sj * SUBCHUNK_HEIGHT;
-		size_t end_j   = start_j + SUBCHUNK_HEIGHT;
-		if (end_j >= VSCREEN_HEIGHT)
-			end_j = VSCREEN_HEIGHT;
+	if (PARALLEL_UPDATE)
+		update_gameboard_parallel(left_to_right);
+	else
+		update_gameboard_serial(left_to_right);
 
+	/* The top row of every rect is read by the subchunk above until the sweep
+	 * ends, stamp it now. The rest of rows were stamped during the sweep. */
+#pragma omp parallel for if (PARALLEL_UPDATE)
+	for (size_t sj = 0; sj < SUBCHUNK_SIZE; ++sj) {
 		for (size_t si = 0; si < SUBCHUNK_SIZE; ++si) {
 			/* Skip inactive subchunks */
-			if (!is_subchunk_active(si, sj))
+			if (!is_frame_subchunk_active(si, sj))
 				continue;
 
-			size_t start_i = si * SUBCHUNK_WIDTH;
-			size_t end_i   = start_i + SUBCHUNK_WIDTH;
-			if (end_i >= VSCREEN_WIDTH)
-				end_i = VSCREEN_WIDTH;
-
-			/* Initial assumption: subchunk will be inactive */
-			subchunk_unset(si, sj);
-			for (size_t j = start_j; j < end_j; ++j) {
-				for (size_t i = start_i; i < end_i; ++i) {
-					const GO_ID go = gameboard[j][i];
-					if (go.updated) {
-						/* Set subchunk active for the next frame */
-						subchunk_set(si, sj);
-						/* Reset gameobject updated bit */
-						gameboard[j][i].updated = 0;
-					}
-				}
-			}
+			const SubchunkRect r = frame_rect(si, sj);
+			if (subchunk_rect_is_empty(r))
+				continue;
+
+			const size_t start_i = si * SUBCHUNK_WIDTH;
+			settle_row_span(sj * SUBCHUNK_HEIGHT + r.y0, start_i + r.x0,
+							start_i + r.x1);
 		}
 	}
 
+	m_parity	  = !m_parity;
 	left_to_right = !left_to_right;
+	++sim_tick;
+
+	/* Changes of two frames ago don't wake anything anymore. Clear them now
+	 * and not when the frame starts, so edits between frames are kept. */
+	changemap_clear(m_parity);
+}
+
+/** Color of the object go at the world cell (wx, wy) in the frame */
+static inline Color object_color(const GO_ID go, const size_t wx,
+								 const size_t wy, const size_t frame) {
+	if (go.raw == GO_NONE.raw)
+		return (Color){0x00, 0x00, 0x00, 0x00};
+
+	if (go_pattern[go.id] != NULL)
+		return GO_PATTERN(go, wx, wy);
+
+	const GameObject *gobj = &GOBJECT(go);
+	return (gobj->draw == NULL) ? gobj->color : gobj->draw(wx, wy, frame);
+}
+
+/** Bits of the word w of a view row with the cells of [x0, x1) */
+static inline movemap_t span_bits(const size_t w, const ssize_t x0,
+								  const ssize_t x1) {
+	const ssize_t lo = clamp_low(x0 - (ssize_t)(w * MOVEMAP_BITS), 0);
+	const ssize_t hi =
+		clamp_high(x1 - (ssize_t)(w * MOVEMAP_BITS), (ssize_t)MOVEMAP_BITS);
+	if (lo >= hi)
+		return 0;
+	return (~(movemap_t)0 >> (MOVEMAP_BITS - (hi - lo))) << lo;
 }
 
+/* World coordinates of the camera the last time it was drawn, far from any
+ * chunk until then. Animated objects out of it missed their frames. */
+static size_t m_drawn_wx = SIZE_MAX / 2;
+static size_t m_drawn_wy = SIZE_MAX / 2;
+
+/* frame_cx the last time the view was drawn */
+static size_t m_drawn_frame = 0;
+
 void draw_gameboard_world(const SDL_FRect *camera) {
 	size_t cam_x = (size_t)(camera->x);
 	size_t cam_y = (size_t)(camera->y);
 
-	/* Plot pixels inside camera to buffer */
-	for (size_t j = 0; j < VIEWPORT_HEIGHT; ++j) {
-		for (size_t i = 0; i < VIEWPORT_WIDTH; ++i) {
-			const size_t x = i + cam_x;
-			const size_t y = j + cam_y;
+	/* World coordinates of the view */
+	const size_t wx0 = vctable[0][0].x * CHUNK_SIZE;
+	const size_t wy0 = vctable[0][0].y * CHUNK_SIZE;
+
+	/* The draw functions get the frame instead of reading frame_cx */
+	const size_t frame = frame_cx;
+
+	/* Animated objects are drawn again when they change their look, and when
+	 * they come into the camera. They are all in the movemap. frame_cx may
+	 * advance several ticks between two draws, or none. */
+	bool animated[MAX_GO_ID + 1] = {false};
+	bool animate[MAX_GO_ID + 1]	 = {false};
+	bool animating				 = false;
+	for (size_t i = 0; i < go_table_size; ++i) {
+		const uint8_t frames = go_table[i].anim_frames;
+		animated[i + 1]		 = frames != 0;
+		animate[i + 1] =
+			frames != 0 && frame / frames != m_drawn_frame / frames;
+		animating |= animate[i + 1];
+	}
 
-			const GO_ID go = gameboard[y][x];
+	/* Columns of the camera that were drawn last time */
+	const ssize_t drawn_x0 = (ssize_t)(m_drawn_wx - wx0);
+	const ssize_t drawn_x1 = drawn_x0 + VIEWPORT_WIDTH;
 
-			if (go.raw == GO_NONE.raw) {
-				vscreen[vscreen_idx(i, j)] = (Color){0x00, 0x00, 0x00, 0x00};
-				continue;
-			}
+	const size_t w0 = cam_x / MOVEMAP_BITS;
+	const size_t w1 = (cam_x + VIEWPORT_WIDTH_M1) / MOVEMAP_BITS;
 
-			const GameObject *gobj = &GOBJECT(go);
-			if (gobj->draw == NULL) {
-				vscreen[vscreen_idx(i, j)] = gobj->color;
-			} else {
-				/* Get world coordinates */
-				const size_t wx = vctable[0][0].x * CHUNK_SIZE + x;
-				const size_t wy = vctable[0][0].y * CHUNK_SIZE + y;
-				gobj->draw(wx, wy, (int)i, (int)j);
+	/* Draw the cells inside the camera that changed. Every row only touches its
+	 * own row of the world buffer and of the drawmap. */
+#pragma omp parallel for schedule(dynamic, DRAW_BAND_ROWS) if (PARALLEL_DRAW)
+	for (size_t j = 0; j < VIEWPORT_HEIGHT; ++j) {
+		const size_t y		   = j + cam_y;
+		const size_t gy		   = GB_Y(y);
+		const bool	 row_drawn = wy0 + y - m_drawn_wy < VIEWPORT_HEIGHT;
+
+		for (size_t w = w0; w <= w1; ++w) {
+			const size_t	gw		= GB_W(w);
+			const movemap_t in_view =
+				span_bits(w, cam_x, cam_x + VIEWPORT_WIDTH);
+			const movemap_t fresh =
+				row_drawn ? in_view & ~span_bits(w, drawn_x0, drawn_x1)
+						  : in_view;
+
+			const movemap_t dirty = m_drawmap[gy][gw] & in_view;
+			m_drawmap[gy][gw] &= ~dirty;
+
+			movemap_t bits = movemap[gy][gw] & (animating ? in_view : fresh);
+			bits |= dirty;
+
+			while (bits) {
+				const size_t	b	= __builtin_ctzll(bits);
+				const movemap_t bit = MOVEMAP_BIT(b);
+				const size_t	gx	= gw * MOVEMAP_BITS + b;
+				const GO_ID		go	= gameboard[gy][gx];
+				bits &= bits - 1;
+
+				if (!(dirty & bit) && !animate[go.id] &&
+					!((fresh & bit) && animated[go.id]))
+					continue;
+
+				m_worldbuffer[gy][gx] = object_color(
+					go, wx0 + w * MOVEMAP_BITS + b, wy0 + y, frame);
 			}
 		}
+
 	}
 
-	/* Render pixels to vscreen and copy to renderer */
-	SDL_UpdateTexture(__vscreen, NULL, vscreen, vscreen_line_size);
-	SDL_RenderCopy(__renderer, __vscreen, NULL, NULL);
+	m_drawn_wx	  = wx0 + cam_x;
+	m_drawn_wy	  = wy0 + cam_y;
+	m_drawn_frame = frame;
+}
+
+void blend_gameboard_row(const SDL_FRect *camera, const size_t j,
+						 Color *line) {
+	const size_t gy	 = GB_Y((size_t)(camera->y) + j);
+	const size_t gx0 = GB_X((size_t)(camera->x));
+
+	/* The row of the camera may wrap around the ring */
+	const size_t first = clamp_high(VIEWPORT_WIDTH, VSCREEN_WIDTH - gx0);
+	Color_blend_span(line, &m_worldbuffer[gy][gx0], first);
+	Color_blend_span(&line[first], m_worldbuffer[gy], VIEWPORT_WIDTH - first);
+}
+
+void draw_gameboard_debug(const SDL_FRect *camera) {
+	size_t cam_x = (size_t)(camera->x);
+	size_t cam_y = (size_t)(camera->y);
 
-	/* Debug draw */
 	if (DBGL(e_dbgl_ui)) {
 		Color c_debug1 = {0, 127, 255, 64};
 		Color c_debug2 = {255, 127, 0, 64};
@@ -651,13 +1821,27 @@ void draw_gameboard_world(const SDL_FRect *camera) {
 					((!is_subchunk_active_world(_i, _j)) ? C_RED : C_GREEN));
 			}
 		}
+
+		/* Draw subchunk dirty rects */
+		Render_Setcolor(c_debug1);
+		for (size_t _sj = 0; _sj < SUBCHUNK_SIZE; ++_sj) {
+			for (size_t _si = 0; _si < SUBCHUNK_SIZE; ++_si) {
+				if (!is_subchunk_active(_si, _sj))
+					continue;
+
+				const SubchunkRect r = subchunk_rect[_sj][_si];
+				Render_Rect((int)(_si * SUBCHUNK_WIDTH + r.x0) - (int)cam_x,
+							(int)(_sj * SUBCHUNK_HEIGHT + r.y0) - (int)cam_y,
+							r.x1 - r.x0 + 1, r.y1 - r.y0 + 1);
+			}
+		}
 	}
 }
 
 static bool F_IS_FLOOR(ssize_t x, ssize_t y) {
-	return gameboard[y][x].raw != GO_NONE.raw &&
-		   ((&GOBJECT(gameboard[y][x]))->type == GO_STATIC ||
-			(&GOBJECT(gameboard[y][x]))->type == GO_POWDER);
+	const GO_ID go = GAMEBOARD(x, y);
+	return go.raw != GO_NONE.raw &&
+		   (GO_TYPE(go) == GO_STATIC || GO_TYPE(go) == GO_POWDER);
 }
 
 void deactivate_soil(size_t si, size_t sj) {
@@ -13,7 +13,11 @@
 #include "gameobjects.h"
 
 extern size_t WORLD_SEED;
+/** Animation ticks, ANIM_TICK_RATE per second whatever the render rate is */
 extern size_t frame_cx;
+/** Cellular automaton ticks, the update step is random but reproducible from
+ * the world seed and this */
+extern size_t sim_tick;
 
 enum e_dbgl /* : int */ {
 	e_dbgl_none	   = 0x1,
@@ -27,30 +31,86 @@ extern int DEBUG_LEVEL;
 
 extern GO_ID gameboard[VSCREEN_HEIGHT][VSCREEN_WIDTH];
 
-extern Color vscreen[VIEWPORT_WIDTH * VIEWPORT_HEIGHT];
-#define vscreen_idx(x, y) (((y) * VIEWPORT_WIDTH) + (x))
+/* The gameboard and the maps of its cells are a toroidal ring of 3x3 chunk
+ * slots. The view cell (x, y) is stored at (x + gameboard_ox, y + gameboard_oy)
+ * wrapped around, so moving the view a chunk away only moves the origin and
+ * writes the incoming slots. Both are multiples of CHUNK_SIZE, so a chunk row
+ * is contiguous in memory and movemap words are never split. */
+extern size_t gameboard_ox;
+extern size_t gameboard_oy;
+
+#define RING_WRAP(_v, _size) ((_v) >= (_size) ? (_v) - (_size) : (_v))
+#define GB_X(_x)                                                               \
+	RING_WRAP((size_t)(_x) + gameboard_ox, VSCREEN_WIDTH)
+#define GB_Y(_y)                                                               \
+	RING_WRAP((size_t)(_y) + gameboard_oy, VSCREEN_HEIGHT)
+
+/** Cell of the gameboard at the view coordinates (x, y) */
+#define GAMEBOARD(_x, _y) (gameboard[GB_Y(_y)][GB_X(_x)])
+
+/** Move the view dx chunks right and dy chunks down. The cells that are still
+ * in view keep their memory, and their subchunks keep their dirty rects and
+ * soil. The ones that left it are overwritten by the chunks loaded in their
+ * slots, see gameboard_chunk_loaded(). */
+void gameboard_scroll(ssize_t dx, ssize_t dy);
+
 #define vscreen_line_size (VIEWPORT_WIDTH * sizeof(Color))
 
-/* 16-bit subchunk_t means 16x16 subchunks filling VSCREEN */
+/* 12x12 subchunks filling VSCREEN, a row of them fits in a subchunk_t. A chunk
+ * is 4x4 subchunks, so their state moves with the chunks. They are wider than
+ * a movemap word plus twice GO_MAX_REACH, so the update workers of subchunks
+ * that are not neighbours never write the same word. */
 typedef uint16_t subchunk_t;
 
-#define SUBCHUNK_SIZE	(8 * sizeof(subchunk_t))
-#define SUBCHUNK_HEIGHT (VSCREEN_HEIGHT / SUBCHUNK_SIZE)
-#define SUBCHUNK_WIDTH	(VSCREEN_WIDTH / SUBCHUNK_SIZE)
+#define SUBCHUNK_SIZE		12
+#define SUBCHUNK_HEIGHT		(VSCREEN_HEIGHT / SUBCHUNK_SIZE)
+#define SUBCHUNK_WIDTH		(VSCREEN_WIDTH / SUBCHUNK_SIZE)
+#define SUBCHUNKS_PER_CHUNK (SUBCHUNK_SIZE / 3)
 
+/** Coarse index over subchunk_rect, one bit per subchunk with a dirty rect */
 extern subchunk_t subchunkopt[SUBCHUNK_SIZE];
-#define SUBCHUNK_ROW_COMPLETE ((subchunk_t)~0)
+#define SUBCHUNK_ROW_COMPLETE ((subchunk_t)(BIT(SUBCHUNK_SIZE) - 1))
+
+/** Dirty rectangle of a subchunk, inclusive and local to the subchunk. It is
+ * empty when x0 > x1. Packed in 32 bits so it can be grown atomically. */
+typedef union _SubchunkRect {
+	uint32_t raw;
+	struct {
+		uint8_t x0;
+		uint8_t y0;
+		uint8_t x1;
+		uint8_t y1;
+	};
+} SubchunkRect;
+extern SubchunkRect subchunk_rect[SUBCHUNK_SIZE][SUBCHUNK_SIZE];
+
+#define SUBCHUNK_RECT_EMPTY ((SubchunkRect){.x0 = 0xFF, .y0 = 0xFF})
+#define SUBCHUNK_RECT_FULL                                                     \
+	((SubchunkRect){.x1 = SUBCHUNK_WIDTH - 1, .y1 = SUBCHUNK_HEIGHT - 1})
+#define subchunk_rect_is_empty(_r) ((_r).x0 > (_r).x1)
 
 typedef struct _SoilData {
 	b2Body *body;
 } SoilData;
 extern SoilData soil_body[SUBCHUNK_SIZE][SUBCHUNK_SIZE];
 
-#define subchunk_set(_i, _j)   (subchunkopt[(_j)] |= BIT(_i))
-#define subchunk_unset(_i, _j) (subchunkopt[(_j)] &= ~BIT(_i))
+/* Atomic so parallel update workers can activate subchunks, but only written
+ * when the bit is missing to keep the cache line shared between cores. */
+#define subchunk_set(_i, _j)                                                   \
+	((void)(is_subchunk_active(_i, _j) ||                                      \
+			__atomic_or_fetch(&subchunkopt[(_j)], BIT(_i), __ATOMIC_RELAXED)))
+#define subchunk_unset(_i, _j)                                                 \
+	{                                                                          \
+		subchunkopt[(_j)] &= ~BIT(_i);                                         \
+		subchunk_rect[(_j)][(_i)] = SUBCHUNK_RECT_EMPTY;                       \
+	}
 
-#define subchunk_set_world(_x, _y)                                             \
-	subchunk_set((_x) / SUBCHUNK_WIDTH, (_y) / SUBCHUNK_HEIGHT)
+/** Grow the dirty rects with the cell (x, y) and its 8 neighbours, which are
+ * the cells that may move after (x, y) changes, and wake them up. Safe from
+ * update workers. */
+void subchunk_mark_world(size_t x, size_t y);
+
+#define subchunk_set_world(_x, _y) subchunk_mark_world(_x, _y)
 #define subchunk_unset_world(_x, _y)                                           \
 	subchunk_unset((_x) / SUBCHUNK_WIDTH, (_y) / SUBCHUNK_HEIGHT)
 
@@ -58,17 +118,85 @@ extern SoilData soil_body[SUBCHUNK_SIZE][SUBCHUNK_SIZE];
 #define is_subchunk_active_world(_x, _y)                                       \
 	is_subchunk_active((_x) / SUBCHUNK_WIDTH, (_y) / SUBCHUNK_HEIGHT)
 
+/* One bit per cell that may move, that is neither empty nor GO_STATIC. The
+ * update sweep only visits the cells set here. */
+typedef uint64_t movemap_t;
+
+#define MOVEMAP_BITS  (8 * sizeof(movemap_t))
+#define MOVEMAP_WIDTH (VSCREEN_WIDTH / MOVEMAP_BITS)
+extern movemap_t movemap[VSCREEN_HEIGHT][MOVEMAP_WIDTH];
+
+#define MOVEMAP_BIT(_x) ((movemap_t)1 << ((_x) % MOVEMAP_BITS))
+/** Word of a map with the bit of the view cell (x, y) */
+#define MOVEMAP_WORD(_map, _x, _y) ((_map)[GB_Y(_y)][GB_X(_x) / MOVEMAP_BITS])
+/** Word of the ring rows that stores the word w of the view rows */
+#define GB_W(_w) (GB_X((_w) * MOVEMAP_BITS) / MOVEMAP_BITS)
+/* Plain read-modify-write, the workers of a checkerboard phase are more than
+ * a word away from each other */
+#define movemap_set(_x, _y)                                                    \
+	(MOVEMAP_WORD(movemap, _x, _y) |= MOVEMAP_BIT(_x))
+#define movemap_unset(_x, _y)                                                  \
+	(MOVEMAP_WORD(movemap, _x, _y) &= ~MOVEMAP_BIT(_x))
+
+/* One bit per cell that is awake. Cells that fail to move after GO_REST_TICKS
+ * updates without falling go to sleep, and any change around them wakes them
+ * up again. The update sweep skips the sleeping ones. */
+extern movemap_t awakemap[VSCREEN_HEIGHT][MOVEMAP_WIDTH];
+
+#define awakemap_set(_x, _y)                                                   \
+	(MOVEMAP_WORD(awakemap, _x, _y) |= MOVEMAP_BIT(_x))
+#define awakemap_unset(_x, _y)                                                 \
+	(MOVEMAP_WORD(awakemap, _x, _y) &= ~MOVEMAP_BIT(_x))
+
+/** Per cell state, it travels with the object when it moves */
+extern GO_State gamestate[VSCREEN_HEIGHT][VSCREEN_WIDTH];
+#define GAMESTATE(_x, _y) (gamestate[GB_Y(_y)][GB_X(_x)])
+
+#define GO_REST_TICKS 8
+
+/** Rebuild the maps of the chunk at gameboard[vy][vx] and reset the state of
+ * its cells after loading it. Its subchunks are updated in the next frame, and
+ * so are the cells around it. */
+void gameboard_chunk_loaded(size_t vx, size_t vy);
+
+/** Write a cell of the gameboard out of the update step, like the brush does.
+ * Keeps the movemap and the dirty rects in sync. */
+void gameboard_set(size_t x, size_t y, GO_ID go);
+
+/* Also wakes up every cell */
 #define ResetSubchunks                                                         \
 	for (uint_fast8_t __j = 0; __j < SUBCHUNK_SIZE; ++__j) {                   \
 		subchunkopt[__j] = SUBCHUNK_ROW_COMPLETE;                              \
-		for (uint_fast8_t __i = 0; __i < SUBCHUNK_SIZE; ++__i)                 \
+		memset(awakemap[__j * SUBCHUNK_HEIGHT], 0xFF,                          \
+			   SUBCHUNK_HEIGHT * sizeof(awakemap[0]));                         \
+		for (uint_fast8_t __i = 0; __i < SUBCHUNK_SIZE; ++__i) {               \
+			subchunk_rect[__j][__i] = SUBCHUNK_RECT_FULL;                      \
 			deactivate_soil(__i, __j);                                         \
+		}                                                                      \
 	}
 
+/** When true, update_gameboard() spreads the subchunks across all cores with a
+ * 2x2 checkerboard schedule. Otherwise it walks them on the calling thread. */
+extern bool PARALLEL_UPDATE;
+
+/** When true, the view is drawn in bands of DRAW_BAND_ROWS rows across all
+ * cores. Otherwise it's drawn on the calling thread. */
+extern bool PARALLEL_DRAW;
+#define DRAW_BAND_ROWS 8
+
 /** Returns true if any object was updated, false otherwise */
 void update_gameboard();
+
+/** Draw the cells of the camera that changed into the world buffer */
 void draw_gameboard_world(const SDL_FRect *camera);
 
+/** Blend the row j of the camera, out of the world buffer, over the
+ * VIEWPORT_WIDTH colors of line */
+void blend_gameboard_row(const SDL_FRect *camera, size_t j, Color *line);
+
+/** Draw chunk borders and subchunk state over the screen, when debugging */
+void draw_gameboard_debug(const SDL_FRect *camera);
+
 /* =============================================================== */
 /* Chunks */
 #define CHUNK_MAX_X	  (UINT16_MAX)
@@ -101,26 +229,123 @@ extern Chunk vctable[3][3];
 
 #define INVALID_CACHE_CHUNK ((seed_t)~0)
 typedef struct _CacheChunk {
-	Chunk chunk_id;
-	GO_ID chunk_data[CHUNK_MEMSIZE];
+	Chunk	 chunk_id;	 /* Modified until it's saved to disk */
+	bool	 referenced; /* Used since the clock hand last passed */
+	uint32_t next;		 /* Next entry in the same bucket */
+	GO_ID	 chunk_data[CHUNK_MEMSIZE];
 } CacheChunk;
 
-void cache_chunk_init();
-void cache_chunk_flushall();
+/** Chunk replaced in the hot tier, packed in the log of the cold tier */
+typedef struct _PackedChunk {
+	Chunk	 chunk_id; /* Modified until it's saved to disk */
+	uint32_t next;	   /* Next entry in the same bucket */
+	uint32_t size;	   /* Packed bytes */
+	size_t	 offset;   /* Log bytes written before it */
+} PackedChunk;
+
+/* The cache takes a share of the system memory, within these bounds */
+#define CHUNK_CACHE_RAM_SHARE	16
+#define CHUNK_CACHE_MIN_MB		8
+#define CHUNK_CACHE_MAX_MB		1024
+#define CHUNK_CACHE_MIN_ENTRIES 16
+
+/* Share of the budget kept raw, the rest is the log of packed chunks. Terrain
+ * packs about 45 times, so room is made for a packed chunk every 1 KB. */
+#define CHUNK_CACHE_HOT_SHARE	4
+#define CHUNK_CACHE_MIN_LOG		(2 * CHUNK_MEMSIZE)
+#define CHUNK_CACHE_PACKED_AVG	1024
+
+typedef struct _CacheStats {
+	size_t entries; /* Raw chunks the budget fits */
+	size_t used;
+	size_t dirty;
+	size_t packed;		 /* Chunks in the cold tier */
+	size_t packed_bytes; /* Log bytes they take */
+	size_t hits;		 /* Chunks loaded from the cache */
+	size_t misses;		 /* Chunks loaded from elsewhere */
+	size_t unpacks;		 /* Chunks brought back from the cold tier */
+	size_t evictions;	 /* Chunks dropped out of the cache */
+	size_t writes;
+} CacheStats;
+
+/** Splits budget_mb megabytes between raw and packed chunks, in one arena that
+ * can be backed by huge pages */
+void cache_chunk_init(size_t budget_mb, bool huge_pages);
+
+/** Saves every modified cached chunk. Returns false if some couldn't be saved,
+ * they stay modified. */
+bool cache_chunk_flushall();
+
+/** Fills stats with the cache occupancy and the counts since init */
+void cache_chunk_stats(CacheStats *stats);
+
+/** Saves to disk a modified cached chunk among the next ones to be replaced.
+ * Called once per frame, chunk crossings find them already saved. */
+void cache_chunk_writeback();
 
 /** Saves the chunk gameboard[vy][vx] in cache. The modified flag will tell if
  * the chunk is marked for disk storage when this cached is flushed out. */
 void cache_chunk(Chunk chunk_id, const size_t vy, const size_t vx);
 
+/** Tells whether the chunk is in either tier, without unpacking it */
+bool cache_has_chunk(Chunk chunk_id);
+
 /** Returns the cached chunk data, or NULL if it's not in cache. Flags are
- * insensitive. */
+ * insensitive. A packed chunk is unpacked back to the hot tier. */
 GO_ID *cache_get_chunk(Chunk chunk_id);
 
 #define GEN_WATERSEA_OFFSET_X 128
 #define GEN_SKY_Y			  32
 #define GEN_TOP_LAYER_Y		  48
 #define GEN_BEDROCK_MARGIN_Y  (CHUNK_MAX_Y - 1)
-void generate_chunk(seed_t SEED, Chunk CHUNK, const size_t vx, const size_t vy);
+/** Generates the rows [y0, y1) of CHUNK into chunk_data. Rows don't depend on
+ * each other, so a chunk can be generated a few rows at a time. */
+void generate_chunk(seed_t SEED, Chunk CHUNK, GO_ID *chunk_data,
+					const size_t y0, const size_t y1);
+
+/* Chunk staging.
+ * The ring of chunks around the view is read or generated ahead of time, the
+ * ones the player is heading to first, so that crossing a border only has to
+ * copy them in. Workers generate them, the disk is read on the main thread. */
+#define CHUNK_STAGE_SLOTS		20 /* The ring of 16, and some to spare */
+#define CHUNK_STAGE_MAX_WORKERS 4
+#define CHUNK_STAGE_UNWANTED	SIZE_MAX
+#define CHUNK_STAGE_LOOKAHEAD	30 /* Frames of player motion to look ahead */
+#define CHUNK_STAGE_ROWS		8
+#define CHUNK_STAGE_BUDGET_US	2000
+
+typedef enum {
+	STAGE_FREE,
+	STAGE_PENDING, /* Not looked up on the disk yet */
+	STAGE_QUEUED,  /* Waiting to be generated */
+	STAGE_WORKING, /* Being generated */
+	STAGE_READY,
+} StageState;
+
+typedef struct _StageChunk {
+	Chunk	   chunk_id;
+	StageState state;
+	size_t	   priority; /* Lower is sooner */
+	size_t	   rows;	 /* Rows of chunk_data ready, CHUNK_SIZE when done */
+	GO_ID	   chunk_data[CHUNK_MEMSIZE];
+} StageChunk;
+
+/** Starts the staging workers. With no workers, chunk_stage_step generates
+ * the chunks itself, a few rows per frame. */
+void chunk_stage_init(size_t workers);
+void chunk_stage_quit();
+
+/** Sets the chunks to stage, most urgent first. Chunks that were already
+ * staged keep their progress. */
+void chunk_stage_want(const Chunk *chunks, size_t count);
+
+/** Reads the wanted chunks that were saved to disk, for budget_us
+ * microseconds at most. Without workers it generates the others too. */
+void chunk_stage_step(size_t budget_us);
+
+/** Copies a chunk into the gameboard slot at view (vx, vy). It comes from the
+ * cache, else from its stage, else from the disk, otherwise it's generated. */
+void load_chunk(Chunk chunk_id, size_t vx, size_t vy);
 
 /* =============================================================== */
 /* Box2D world */
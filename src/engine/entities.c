@@ -2,8 +2,6 @@
 
 #include "bonerig.h"
 
-#include "../disk/worldctrl.h"
-
 #define SLOPE 4
 
 Bone player_bone_rig[] = {
@@ -185,11 +183,54 @@ void move_player(Player *player, const Uint8 *keyboard) {
 	}
 }
 
-#define dereference_chunk_by_lines(addr_, vy_, vx_)                            \
-	for (size_t __k = 0; __k < CHUNK_SIZE; ++__k) {                            \
-		memcpy(&gameboard[(vy_ + __k)][vx_], (addr_) + (__k * CHUNK_SIZE),     \
-			   CHUNK_SIZE);                                                    \
+/** Stages the ring of chunks around the view, the ones the player is heading
+ * to first */
+static void stage_next_chunks(const Player *player) {
+	const Chunk id = player->chunk_id;
+	Chunk		chunks[CHUNK_STAGE_SLOTS];
+	float		distances[CHUNK_STAGE_SLOTS];
+	size_t		count = 0;
+
+	/* Where the player will be if it keeps moving this way */
+	const float ahead_x =
+		player->x + (player->x - player->prev_x) * CHUNK_STAGE_LOOKAHEAD;
+	const float ahead_y =
+		player->y + (player->y - player->prev_y) * CHUNK_STAGE_LOOKAHEAD;
+
+	for (int j = -2; j <= 2; ++j) {
+		for (int i = -2; i <= 2; ++i) {
+			/* In view already */
+			if (abs(i) < 2 && abs(j) < 2)
+				continue;
+
+			/* The view stops at the world borders */
+			if ((i == -2 && id.x <= 1) || (i == 2 && id.x >= CHUNK_MAX_X - 1) ||
+				(j == -2 && id.y <= 1) || (j == 2 && id.y >= CHUNK_MAX_Y - 1))
+				continue;
+
+			/* Distance to the chunk center, in view coordinates */
+			const float distance =
+				fabsf((i + 1) * CHUNK_SIZE + CHUNK_SIZE_DIV_2 - ahead_x) +
+				fabsf((j + 1) * CHUNK_SIZE + CHUNK_SIZE_DIV_2 - ahead_y);
+
+			/* Keep them sorted, nearest first */
+			size_t k = count++;
+			for (; k > 0 && distances[k - 1] > distance; --k) {
+				chunks[k]	 = chunks[k - 1];
+				distances[k] = distances[k - 1];
+			}
+			chunks[k] = (Chunk){
+				.x		  = id.x + i,
+				.y		  = id.y + j,
+				.modified = 0,
+			};
+			distances[k] = distance;
+		}
 	}
+
+	chunk_stage_want(chunks, count);
+}
+
 /** This is called after box2d_world_step */
 void move_camera(Player *player, SDL_FRect *camera) {
 	float bx, by;
@@ -222,8 +263,7 @@ void move_camera(Player *player, SDL_FRect *camera) {
 				(float)CHUNK_SIZE_M2 - (CHUNK_SIZE - player->prev_y);
 			--player->chunk_id.y;
 
-			/* Move world to bottom */
-			deactivate_soil_all;
+			/* Move world to bottom, soil included */
 			box2d_world_move_all_bodies(b2_world, 0, X_TO_U(CHUNK_SIZE));
 
 			/* Save modified chunks to cache before erasing */
@@ -234,10 +274,10 @@ void move_camera(Player *player, SDL_FRect *camera) {
 			if (vctable[2][2].modified)
 				cache_chunk(vctable[2][2], CHUNK_SIZE_M2, CHUNK_SIZE_M2);
 
-			/* Overwrite vctable and gameboard */
+			/* Overwrite vctable, the bottom slots of the gameboard are the
+			 * top ones now */
 			memmove(&vctable[1][0], &vctable[0][0], 6 * sizeof(Chunk));
-			memmove(&gameboard[CHUNK_SIZE][0], &gameboard[0][0],
-					CHUNK_SIZE_M2 * VSCREEN_WIDTH);
+			gameboard_scroll(0, -1);
 
 			/* Generate new world at top */
 			chunk_xaxis_t start_x = player->chunk_id.x - 1;
@@ -252,21 +292,8 @@ void move_camera(Player *player, SDL_FRect *camera) {
 				const size_t vx = i * CHUNK_SIZE;
 				const size_t vy = 0;
 
-				/* Find chunk in cache, else read it from disk,
-				 * otherwise generate it. */
-				GO_ID *chunk_data = cache_get_chunk(chunk);
-				if (chunk_data != NULL) {
-					dereference_chunk_by_lines(chunk_data, vy, vx);
-				} else {
-					GO_ID chunk_data_disk[CHUNK_MEMSIZE];
-					if (load_chunk_from_disk(chunk, chunk_data_disk)) {
-						dereference_chunk_by_lines(chunk_data_disk, vy, vx);
-					} else {
-						generate_chunk(WORLD_SEED, chunk, vx, vy);
-					}
-				}
+				load_chunk(chunk, vx, vy);
 			}
-			ResetSubchunks;
 		}
 
 		camera->y = clamp(player->y - VIEWPORT_HEIGHT_DIV_2, 0,
@@ -286,8 +313,7 @@ void move_camera(Player *player, SDL_FRect *camera) {
 				(float)CHUNK_SIZE + (player->prev_y - CHUNK_SIZE_M2);
 			++player->chunk_id.y;
 
-			/* Move world to top */
-			deactivate_soil_all;
+			/* Move world to top, soil included */
 			box2d_world_move_all_bodies(b2_world, 0, -X_TO_U(CHUNK_SIZE));
 
 			/* Save modified chunks to cache before erasing */
@@ -298,10 +324,10 @@ void move_camera(Player *player, SDL_FRect *camera) {
 			if (vctable[0][2].modified)
 				cache_chunk(vctable[0][2], 0, CHUNK_SIZE_M2);
 
-			/* Overwrite vctable and gameboard */
+			/* Overwrite vctable, the top slots of the gameboard are the
+			 * bottom ones now */
 			memmove(&vctable[0][0], &vctable[1][0], 6 * sizeof(Chunk));
-			memmove(&gameboard[0][0], &gameboard[CHUNK_SIZE][0],
-					CHUNK_SIZE_M2 * VSCREEN_WIDTH);
+			gameboard_scroll(0, 1);
 
 			/* Generate new world at bottom */
 			chunk_xaxis_t start_x = player->chunk_id.x - 1;
@@ -316,21 +342,8 @@ void move_camera(Player *player, SDL_FRect *camera) {
 				const size_t vx = i * CHUNK_SIZE;
 				const size_t vy = CHUNK_SIZE_M2;
 
-				/* Find chunk in cache, else read it from disk,
-				 * otherwise generate it. */
-				GO_ID *chunk_data = cache_get_chunk(chunk);
-				if (chunk_data != NULL) {
-					dereference_chunk_by_lines(chunk_data, vy, vx);
-				} else {
-					GO_ID chunk_data_disk[CHUNK_MEMSIZE];
-					if (load_chunk_from_disk(chunk, chunk_data_disk)) {
-						dereference_chunk_by_lines(chunk_data_disk, vy, vx);
-					} else {
-						generate_chunk(WORLD_SEED, chunk, vx, vy);
-					}
-				}
+				load_chunk(chunk, vx, vy);
 			}
-			ResetSubchunks;
 		}
 
 		camera->y = clamp(player->y - VIEWPORT_HEIGHT_DIV_2, 0,
@@ -350,8 +363,7 @@ void move_camera(Player *player, SDL_FRect *camera) {
 				(float)CHUNK_SIZE_M2 - (CHUNK_SIZE - player->prev_x);
 			--player->chunk_id.x;
 
-			/* Move world to right */
-			deactivate_soil_all;
+			/* Move world to right, soil included */
 			box2d_world_move_all_bodies(b2_world, X_TO_U(CHUNK_SIZE), 0);
 
 			/* Save modified chunks to cache before erasing */
@@ -362,15 +374,13 @@ void move_camera(Player *player, SDL_FRect *camera) {
 			if (vctable[2][2].modified)
 				cache_chunk(vctable[2][2], CHUNK_SIZE_M2, CHUNK_SIZE_M2);
 
-			/* Overwrite vctable and gameboard */
+			/* Overwrite vctable, the right slots of the gameboard are the
+			 * left ones now */
 			for (uint_fast16_t j = 0; j < 3; ++j) {
 				vctable[j][2] = vctable[j][1];
 				vctable[j][1] = vctable[j][0];
 			}
-			for (uint_fast16_t j = 0; j < VSCREEN_HEIGHT; ++j) {
-				memmove(&gameboard[j][CHUNK_SIZE], &gameboard[j][0],
-						CHUNK_SIZE_M2);
-			}
+			gameboard_scroll(-1, 0);
 
 			/* Generate new world at left */
 			chunk_yaxis_t start_j = player->chunk_id.y - 1;
@@ -385,21 +395,8 @@ void move_camera(Player *player, SDL_FRect *camera) {
 				const size_t vx = 0;
 				const size_t vy = j * CHUNK_SIZE;
 
-				/* Find chunk in cache, else read it from disk,
-				 * otherwise generate it. */
-				GO_ID *chunk_data = cache_get_chunk(chunk);
-				if (chunk_data != NULL) {
-					dereference_chunk_by_lines(chunk_data, vy, vx);
-				} else {
-					GO_ID chunk_data_disk[CHUNK_MEMSIZE];
-					if (load_chunk_from_disk(chunk, chunk_data_disk)) {
-						dereference_chunk_by_lines(chunk_data_disk, vy, vx);
-					} else {
-						generate_chunk(WORLD_SEED, chunk, vx, vy);
-					}
-				}
+				load_chunk(chunk, vx, vy);
 			}
-			ResetSubchunks;
 		}
 
 		camera->x = clamp(player->x - VIEWPORT_WIDTH_DIV_2, 0,
@@ -419,8 +416,7 @@ void move_camera(Player *player, SDL_FRect *camera) {
 				(float)CHUNK_SIZE + (player->prev_x - CHUNK_SIZE_M2);
 			++player->chunk_id.x;
 
-			/* Move world to left */
-			deactivate_soil_all;
+			/* Move world to left, soil included */
 			box2d_world_move_all_bodies(b2_world, -X_TO_U(CHUNK_SIZE), 0);
 
 			/* Save modified chunks to cache before erasing */
@@ -431,15 +427,13 @@ void move_camera(Player *player, SDL_FRect *camera) {
 			if (vctable[2][0].modified)
 				cache_chunk(vctable[2][0], CHUNK_SIZE_M2, 0);
 
-			/* Overwrite vctable and gameboard */
+			/* Overwrite vctable, the left slots of the gameboard are the
+			 * right ones now */
 			for (uint_fast16_t j = 0; j < 3; ++j) {
 				vctable[j][0] = vctable[j][1];
 				vctable[j][1] = vctable[j][2];
 			}
-			for (uint_fast16_t j = 0; j < VSCREEN_HEIGHT; ++j) {
-				memmove(&gameboard[j][0], &gameboard[j][CHUNK_SIZE],
-						CHUNK_SIZE_M2);
-			}
+			gameboard_scroll(1, 0);
 
 			/* Generate new world at right */
 			chunk_yaxis_t start_j = player->chunk_id.y - 1;
@@ -455,21 +449,8 @@ void move_camera(Player *player, SDL_FRect *camera) {
 				const size_t vx = CHUNK_SIZE_M2;
 				const size_t vy = j * CHUNK_SIZE;
 
-				/* Find chunk in cache, else read it from disk,
-				 * otherwise generate it. */
-				GO_ID *chunk_data = cache_get_chunk(chunk);
-				if (chunk_data != NULL) {
-					dereference_chunk_by_lines(chunk_data, vy, vx);
-				} else {
-					GO_ID chunk_data_disk[CHUNK_MEMSIZE];
-					if (load_chunk_from_disk(chunk, chunk_data_disk)) {
-						dereference_chunk_by_lines(chunk_data_disk, vy, vx);
-					} else {
-						generate_chunk(WORLD_SEED, chunk, vx, vy);
-					}
-				}
+				load_chunk(chunk, vx, vy);
 			}
-			ResetSubchunks;
 		}
 
 		camera->x = clamp(player->x - VIEWPORT_WIDTH_DIV_2, 0,
@@ -485,12 +466,91 @@ void move_camera(Player *player, SDL_FRect *camera) {
 		box2d_body_set_position(player->body, X_TO_U(player->x),
 								X_TO_U(player->y));
 	}
+
+	stage_next_chunks(player);
+}
+
+/** Color of the pixel x,y of the surface */
+static Color surface_pixel(const SDL_Surface *surface, int x, int y) {
+	const Uint8 *p = (const Uint8 *)surface->pixels + y * surface->pitch +
+					 x * surface->format->BytesPerPixel;
+
+	Uint32 pixel = 0;
+	memcpy(&pixel, p, surface->format->BytesPerPixel);
+
+	Color color;
+	SDL_GetRGBA(pixel, surface->format, &color.r, &color.g, &color.b,
+				&color.a);
+	return color;
+}
+
+/** Draw the subimage of the skin, scaled down by PSF, flipped and rotated
+ * around its center like SDL_RenderCopyExF() does, at x,y of the layer */
+static void draw_skin(const SDL_Surface *surface, const SkinRig *skinrig,
+					  float x, float y, double angle, bool fliph,
+					  PlayerLayer *layer) {
+	const float w = (float)skinrig->subimage.w / PSF;
+	const float h = (float)skinrig->subimage.h / PSF;
+
+	/* Rotation pivot in the layer */
+	const float cx = x + skinrig->center.x;
+	const float cy = y + skinrig->center.y;
+
+	const float a	  = degtorad(angle);
+	const float cos_a = cosf(a);
+	const float sin_a = sinf(a);
+
+	/* Layer pixels around the rotated skin */
+	const float r  = hypotf(fmaxf(skinrig->center.x, w - skinrig->center.x),
+							fmaxf(skinrig->center.y, h - skinrig->center.y));
+	const int	i0 = clamp((int)floorf(cx - r), 0, PLAYER_LAYER_SIZE);
+	const int	i1 = clamp((int)ceilf(cx + r), 0, PLAYER_LAYER_SIZE);
+	const int	j0 = clamp((int)floorf(cy - r), 0, PLAYER_LAYER_SIZE);
+	const int	j1 = clamp((int)ceilf(cy + r), 0, PLAYER_LAYER_SIZE);
+
+	for (int j = j0; j < j1; ++j) {
+		for (int i = i0; i < i1; ++i) {
+			/* Rotate the pixel center back into the skin */
+			const float dx = (i + 0.5f) - cx;
+			const float dy = (j + 0.5f) - cy;
+			float		u  = dx * cos_a + dy * sin_a + skinrig->center.x;
+			const float v  = dy * cos_a - dx * sin_a + skinrig->center.y;
+
+			if (u < 0.0f || u >= w || v < 0.0f || v >= h)
+				continue;
+			if (fliph)
+				u = w - u;
+
+			const int sx = clamp((int)(u * PSF), 0, skinrig->subimage.w - 1);
+			const int sy = clamp((int)(v * PSF), 0, skinrig->subimage.h - 1);
+
+			const Color color =
+				surface_pixel(surface, skinrig->subimage.x + sx,
+							  skinrig->subimage.y + sy);
+
+			/* Keep the colors straight, the layer is blended again later */
+			Color *dst = &layer->pixels[j][i];
+			if (dst->a == 0)
+				*dst = color;
+			else if (color.a != 0)
+				*dst = Color_blend(color, *dst);
+		}
+	}
 }
 
-void draw_player(Player *player, SDL_FRect *camera) {
+void draw_player(const Player *player, const SDL_FRect *camera,
+				 PlayerLayer *layer) {
 	const float player_screen_x = player->x - camera->x;
 	const float player_screen_y = player->y - camera->y;
 
+	layer->x = (int)floorf(player_screen_x) - PLAYER_LAYER_SIZE_2;
+	layer->y = (int)floorf(player_screen_y) - PLAYER_LAYER_SIZE_2;
+	memset(layer->pixels, 0, sizeof(layer->pixels));
+
+	SDL_Surface *surface = player->sprite->surface;
+	if (SDL_LockSurface(surface) != 0)
+		return;
+
 	const float player_angle	 = box2d_body_get_angle(player->body);
 	const float player_angle_deg = radtodeg(player_angle);
 
@@ -504,14 +564,25 @@ void draw_player(Player *player, SDL_FRect *camera) {
 
 		double angle = bone->anim_data.angle + player_angle_deg;
 
-		SDL_FRect skin_dst = {bone_x, bone_y,
-							  ((float)skinrig->subimage.w / PSF),
-							  ((float)skinrig->subimage.h / PSF)};
-		skin_dst.x += player_screen_x - skinrig->center.x + 0.5f;
-		skin_dst.y += player_screen_y - skinrig->center.y - 0.5f;
+		float skin_x = bone_x + player_screen_x - skinrig->center.x + 0.5f;
+		float skin_y = bone_y + player_screen_y - skinrig->center.y - 0.5f;
 
-		SDL_RenderCopyExF(__renderer, player->sprite->texture,
-						  &skinrig->subimage, &skin_dst, angle,
-						  &skinrig->center, player->fliph);
+		draw_skin(surface, skinrig, skin_x - layer->x, skin_y - layer->y,
+				  angle, player->fliph, layer);
 	}
+
+	SDL_UnlockSurface(surface);
+}
+
+void blend_player_row(const PlayerLayer *layer, size_t y, Color *line) {
+	const int j = (int)y - layer->y;
+	if (j < 0 || j >= PLAYER_LAYER_SIZE)
+		return;
+
+	const int x0 = clamp_low(layer->x, 0);
+	const int x1 = clamp_high(layer->x + PLAYER_LAYER_SIZE, VIEWPORT_WIDTH);
+	if (x0 >= x1)
+		return;
+
+	Color_blend_span(&line[x0], &layer->pixels[j][x0 - layer->x], x1 - x0);
 }
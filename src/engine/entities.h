@@ -31,9 +31,26 @@ typedef struct _Player {
 	BoneAnimation *animation;
 } Player;
 
+/* Side of the square the player is drawn into, around its position */
+#define PLAYER_LAYER_SIZE	64
+#define PLAYER_LAYER_SIZE_2 (PLAYER_LAYER_SIZE / 2)
+
+typedef struct _PlayerLayer {
+	int	  x, y; /* Top left corner in the viewport */
+	Color pixels[PLAYER_LAYER_SIZE][PLAYER_LAYER_SIZE];
+} PlayerLayer;
+
 void create_player_body(Player *player);
 void move_player(Player *player, const Uint8 *keyboard);
 void move_camera(Player *player, SDL_FRect *camera);
-void draw_player(Player *player, SDL_FRect *camera);
+
+/** Draw the skins of the player into its layer, transparent around them, so
+ * it's composed between the sky and the world */
+void draw_player(const Player *player, const SDL_FRect *camera,
+				 PlayerLayer *layer);
+
+/** Blend the player over the row y of the viewport, in the VIEWPORT_WIDTH
+ * colors of line */
+void blend_player_row(const PlayerLayer *layer, size_t y, Color *line);
 
 #endif // _ENTITIES_H
@@ -1,7 +1,5 @@
 #include "gameobjects.h"
 
-#include <math.h>
-
 #include "../graphics/graphics.h"
 #include "noise.h"
 
@@ -13,13 +11,92 @@ GO_ID GO_WATER;
 GO_ID GO_SAND;
 GO_ID GO_STONE;
 
-GO_ID register_gameobject(GO_Type type, float density, Color color,
-						  GO_Draw draw) {
+GO_Type	 go_type[MAX_GO_ID + 1];
+float	 go_density[MAX_GO_ID + 1];
+GO_Rules go_rules[MAX_GO_ID + 1];
+Color	*go_pattern[MAX_GO_ID + 1];
+
+/* Candidate moves of every type */
+static const GO_Rules m_type_rules[] = {
+	[GO_STATIC] = {.count = 0},
+	[GO_POWDER] = {.count = 4,
+				   .moves = {
+					   {0, 1, GO_MOVE_FALL},
+					   {-1, 1, 0},
+					   {1, 1, 0},
+					   {0, 1, GO_MOVE_SINK},
+				   }},
+	[GO_LIQUID] = {.count = 6,
+				   .moves = {
+					   {0, 1, GO_MOVE_FALL},
+					   {-1, 0, GO_MOVE_DISPERSE},
+					   {1, 0, GO_MOVE_DISPERSE},
+					   {-1, 1, 0},
+					   {1, 1, 0},
+					   {0, 1, GO_MOVE_SINK},
+				   }},
+	[GO_GAS]	= {.count = 6,
+				   .moves = {
+					   {0, -1, 0},
+					   {-1, 0, GO_MOVE_DISPERSE},
+					   {1, 0, GO_MOVE_DISPERSE},
+					   {-1, -1, 0},
+					   {1, -1, 0},
+					   {0, 1, GO_MOVE_SINK},
+				   }},
+};
+
+/** Bake the draw function of an object into its pattern tile. Without memory
+ * for it, the object is drawn with the function. */
+static void compile_pattern(const GO_ID id) {
+	const GameObject *gobj = &GOBJECT(id);
+	if (gobj->draw == NULL || gobj->anim_frames != 0)
+		return;
+
+	Color *pattern = malloc(GO_PATTERN_SIZE * GO_PATTERN_SIZE * sizeof(Color));
+	if (pattern == NULL)
+		return;
+
+	for (size_t y = 0; y < GO_PATTERN_SIZE; ++y) {
+		for (size_t x = 0; x < GO_PATTERN_SIZE; ++x)
+			pattern[y * GO_PATTERN_SIZE + x] = gobj->draw(x, y, 0);
+	}
+	go_pattern[id.id] = pattern;
+}
+
+/** Flatten go_table into the property tables used by the update step */
+static void compile_gameobjects() {
+	go_type[GO_NONE.id]	   = GO_STATIC;
+	go_density[GO_NONE.id] = 0.0f;
+	go_rules[GO_NONE.id]   = m_type_rules[GO_STATIC];
+
+	for (size_t i = 0; i < go_table_size; ++i) {
+		const GameObject *gobj = &go_table[i];
+
+		go_type[i + 1]	  = gobj->type;
+		go_density[i + 1] = gobj->density;
+		go_rules[i + 1]	  = m_type_rules[gobj->type];
+		compile_pattern((GO_ID){.raw = i + 1});
+
+		/* Every object flows as far as its own dispersion */
+		GO_Rules *rules = &go_rules[i + 1];
+		for (size_t k = 0; k < rules->count; ++k) {
+			if (rules->moves[k].flags & GO_MOVE_DISPERSE)
+				rules->moves[k].reach =
+					clamp(gobj->dispersion, 1, GO_MAX_REACH);
+		}
+	}
+}
 
-	go_table[go_table_size].type	= type;
-	go_table[go_table_size].density = density;
-	go_table[go_table_size].color	= color;
-	go_table[go_table_size].draw	= draw;
+GO_ID register_gameobject(GO_Type type, float density, uint8_t dispersion,
+						  Color color, GO_Draw draw) {
+
+	go_table[go_table_size].type		= type;
+	go_table[go_table_size].density		= density;
+	go_table[go_table_size].dispersion	= dispersion;
+	go_table[go_table_size].color		= color;
+	go_table[go_table_size].draw		= draw;
+	go_table[go_table_size].anim_frames = 0;
 
 	return (GO_ID){.raw = ++go_table_size};
 }
@@ -31,8 +108,8 @@ static Color C_SAND2 = {0xFB, 0xF4, 0xBD, 0xFF};
 static Color C_SAND3 = {0xEA, 0xE3, 0xAD, 0xFF};
 static Color C_SAND4 = {0xC1, 0xC4, 0x97, 0xFF};
 
-/* Draw pattern for sand */
-static void F_draw_sand(size_t wx, size_t wy, int vx, int vy) {
+/* Draw pattern for sand, it repeats every 256 cells like noise2 */
+static Color F_draw_sand(size_t wx, size_t wy, size_t frame) {
 	/* Pseudo-random seed based only on world coordinates */
 	const size_t seed = wy - (wx ^ wy);
 
@@ -40,17 +117,16 @@ static void F_draw_sand(size_t wx, size_t wy, int vx, int vy) {
 	size_t noise = noise2(wx, wy, seed);
 
 	/* Map noise value to a specific color */
-	const size_t idx = vscreen_idx(vx, vy);
 	if (noise < 6)
-		vscreen[idx] = C_LTGRAY;
+		return C_LTGRAY;
 	else if (noise < 12)
-		vscreen[idx] = C_SAND4;
+		return C_SAND4;
 	else if (noise < 64)
-		vscreen[idx] = C_SAND3;
+		return C_SAND3;
 	else if (noise < 128)
-		vscreen[idx] = C_SAND2;
+		return C_SAND2;
 	else
-		vscreen[idx] = C_SAND;
+		return C_SAND;
 }
 
 static Color C_STONE  = {0x79, 0x7B, 0x7A, 0xFF};
@@ -58,53 +134,73 @@ static Color C_STONE2 = {0x76, 0x78, 0x77, 0xFF};
 static Color C_STONE4 = {0x7D, 0x7F, 0x7E, 0xFF};
 static Color C_STONE3 = {0x73, 0x75, 0x74, 0xFF};
 
-/* Draw pattern for stone */
-static void F_draw_stone(size_t wx, size_t wy, int vx, int vy) {
+/* Draw pattern for stone, it repeats every 256 cells like noise2 */
+static Color F_draw_stone(size_t wx, size_t wy, size_t frame) {
 	size_t noise = noise2(wx, wy, 0);
 
 	/* Map noise value to a specific color */
-	const size_t idx = vscreen_idx(vx, vy);
 	if (noise < 24)
-		vscreen[idx] = C_STONE4;
+		return C_STONE4;
 	else if (noise < 48)
-		vscreen[idx] = C_STONE3;
+		return C_STONE3;
 	else if (noise < 128)
-		vscreen[idx] = C_STONE2;
+		return C_STONE2;
 	else
-		vscreen[idx] = C_STONE;
+		return C_STONE;
 }
 
 static Color C_WATER = {0x7F, 0x8D, 0xFF, 0xAF};
 
-/* Draw pattern for water */
-static void F_draw_water(size_t wx, size_t wy, int vx, int vy) {
-	const double frequency = 0.03;
-	const size_t depth	   = 1;
-
-	const size_t mov = frame_cx / 4;
-
-	/* Generate a pseudo-random value based on Perlin noise */
-	double noise_value =
-		perlin2d(0, (double)wx + mov, (double)wy + mov, frequency, depth);
-
-	/* Normalize noise value to a range of 0-12 */
-	noise_value = fmod(noise_value, 1.0);
-	if (noise_value < 0)
-		noise_value += 1.0;
-	noise_value *= 24.0;
-
-	uint8_t nv = (uint8_t)noise_value;
+/* Water ripples move a cell every few frames */
+#define WATER_ANIM_FRAMES 4
+
+/* Ripples are a tile of smooth noise, with a grid point every
+ * WATER_RIPPLES_CELL cells like perlin2d() at frequency 0.03. The tile holds
+ * the shade of every cell. */
+#define WATER_RIPPLES_SIZE	 512
+#define WATER_RIPPLES_MASK	 (WATER_RIPPLES_SIZE - 1)
+#define WATER_RIPPLES_CELL	 32
+#define WATER_RIPPLES_SHADES 24
+
+static uint8_t m_water_ripples[WATER_RIPPLES_SIZE][WATER_RIPPLES_SIZE];
+static Color   m_water_shades[WATER_RIPPLES_SHADES];
+
+static void init_water_ripples() {
+	for (size_t y = 0; y < WATER_RIPPLES_SIZE; ++y) {
+		for (size_t x = 0; x < WATER_RIPPLES_SIZE; ++x) {
+			const double noise_value = noise2d_tiled(
+				(double)x / WATER_RIPPLES_CELL, (double)y / WATER_RIPPLES_CELL,
+				WATER_RIPPLES_SIZE / WATER_RIPPLES_CELL, 0);
+
+			/* Normalize noise value to a range of 0-23 */
+			m_water_ripples[y][x] = noise_value * WATER_RIPPLES_SHADES / 256;
+		}
+	}
+
+	for (uint8_t nv = 0; nv < WATER_RIPPLES_SHADES; ++nv) {
+		Color color = C_WATER;
+		color.g += nv;
+		color.b -= nv;
+		m_water_shades[nv] = color;
+	}
+}
 
-	Color color = C_WATER;
-	color.g += nv;
-	color.b -= nv;
+/* Draw pattern for water */
+static Color F_draw_water(size_t wx, size_t wy, size_t frame) {
+	const size_t mov = frame / WATER_ANIM_FRAMES;
 
-	vscreen[vscreen_idx(vx, vy)] = color;
+	return m_water_shades[m_water_ripples[(wy + mov) & WATER_RIPPLES_MASK]
+										 [(wx + mov) & WATER_RIPPLES_MASK]];
 }
 
 void init_gameobjects() {
-	GO_VAPOR = register_gameobject(GO_GAS, 0.0f, C_VAPOR, NULL);
-	GO_WATER = register_gameobject(GO_LIQUID, 1.0f, C_WATER, F_draw_water);
-	GO_SAND	 = register_gameobject(GO_POWDER, 2.0f, C_SAND, F_draw_sand);
-	GO_STONE = register_gameobject(GO_STATIC, 3.0f, C_STONE, F_draw_stone);
+	GO_VAPOR = register_gameobject(GO_GAS, 0.0f, 3, C_VAPOR, NULL);
+	GO_WATER = register_gameobject(GO_LIQUID, 1.0f, 5, C_WATER, F_draw_water);
+	GO_SAND	 = register_gameobject(GO_POWDER, 2.0f, 0, C_SAND, F_draw_sand);
+	GO_STONE = register_gameobject(GO_STATIC, 3.0f, 0, C_STONE, F_draw_stone);
+
+	GOBJECT(GO_WATER).anim_frames = WATER_ANIM_FRAMES;
+	init_water_ripples();
+
+	compile_gameobjects();
 }
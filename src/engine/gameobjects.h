@@ -13,7 +13,9 @@ typedef enum GO_Type {
 
 #define GO_IS_FLUID(gtype_) ((gtype_) >= GO_POWDER)
 
-typedef void (*GO_Draw)(size_t wx, size_t wy, int vx, int vy);
+/** Color of the object at the world cell (wx, wy) in the given frame. It may
+ * only depend on its arguments, rows of the view are drawn on many threads. */
+typedef Color (*GO_Draw)(size_t wx, size_t wy, size_t frame);
 
 #pragma pack(push, 1)
 typedef union GO_ID {
@@ -24,11 +26,25 @@ typedef union GO_ID {
 	} PACKED;
 } GO_ID;
 
+/** State of the object in a cell */
+typedef union GO_State {
+	uint8_t raw;
+	struct {
+		bit rest : 4; /* Updates in a row without falling */
+		bit vel	 : 4; /* Extra cells it falls in the next update */
+	} PACKED;
+} GO_State;
+
 typedef struct GameObject {
 	GO_Type type;
 	float	density;
+	uint8_t dispersion; /* Cells a fluid may flow sideways in one update */
 	Color	color;
 	GO_Draw draw;
+	/* Frames between two looks of an animated object, 0 if its look only
+	 * depends on where it is. Animated objects must be movable, they are drawn
+	 * again from the movemap. */
+	uint8_t anim_frames;
 } PACKED GameObject;
 #pragma pack(pop)
 
@@ -47,19 +63,81 @@ extern GO_ID GO_STONE;
 #define GO_LAST		 ((GO_ID){.raw = go_table_size})
 #define GOBJECT(_id) (go_table[(_id).id - 1])
 
+/* =============================================================== */
+/* Compiled rules */
+
+/** Candidate move of an object, relative to its cell. dx is mirrored when the
+ * row is updated from right to left. */
+typedef struct GO_Move {
+	int8_t	dx;
+	int8_t	dy;
+	uint8_t flags;
+	uint8_t reach; /* Steps of (dx, dy) a GO_MOVE_DISPERSE move may take */
+} GO_Move;
+
+/* Scan up to reach cells along the move, through empty cells and cells of the
+ * same object, and jump to the farthest empty one */
+#define GO_MOVE_DISPERSE BIT(0)
+/* Swap with a lighter fluid instead of moving into an empty cell */
+#define GO_MOVE_SINK BIT(1)
+/* Fall through up to 1 + vel empty cells, where vel is the velocity of the
+ * cell, that grows every time it falls */
+#define GO_MOVE_FALL BIT(2)
+
+#define GO_MAX_MOVES 6
+
+/* Longest reach of a move, well below a subchunk so the ones that are not
+ * neighbours can still be updated at the same time */
+#define GO_MAX_REACH 8
+
+/* Velocity of a falling object, so it never falls further than GO_MAX_REACH */
+#define GO_MAX_VELOCITY (GO_MAX_REACH - 1)
+
+/** Candidate moves of an object, in order of preference. Aligned so the moves
+ * of an object never straddle two cache lines. */
+typedef struct GO_Rules {
+	GO_Move moves[GO_MAX_MOVES];
+	uint8_t count;
+} ALIGNED(32) GO_Rules;
+
+/* Structure of arrays compiled from go_table by init_gameobjects(), indexed by
+ * GO_ID.id, so there is no packed GameObject to read in the update step.
+ * Slot 0 is GO_NONE: a static object without moves. */
+extern GO_Type	go_type[MAX_GO_ID + 1];
+extern float	go_density[MAX_GO_ID + 1];
+extern GO_Rules go_rules[MAX_GO_ID + 1];
+
+#define GO_TYPE(_id)	(go_type[(_id).id])
+#define GO_DENSITY(_id) (go_density[(_id).id])
+#define GO_RULES(_id)	(&go_rules[(_id).id])
+
+/* The look of an object that is not animated repeats every GO_PATTERN_SIZE
+ * cells of the world, so its draw function is baked into a tile once and the
+ * world is drawn with lookups. NULL for the objects without draw function and
+ * for animated ones. */
+#define GO_PATTERN_SIZE 256
+#define GO_PATTERN_MASK (GO_PATTERN_SIZE - 1)
+extern Color *go_pattern[MAX_GO_ID + 1];
+
+#define GO_PATTERN(_id, _wx, _wy)                                              \
+	(go_pattern[(_id).id][((_wy) & GO_PATTERN_MASK) * GO_PATTERN_SIZE +        \
+						  ((_wx) & GO_PATTERN_MASK)])
+
 /**
  * \brief Register a new gameobject in the game
  *
  * \param type The type of the gameobject
  * \param density The density of the gameobject
+ * \param dispersion Cells it may flow sideways in one update, for fluids
  * \param color The color of the gameobject
  * \param draw The draw function of the gameobject
  *
  * \return The id of the gameobject [1-127]. Zero is reserved for GO_NONE
  */
-GO_ID register_gameobject(GO_Type type, float density, Color color,
-						  GO_Draw draw);
+GO_ID register_gameobject(GO_Type type, float density, uint8_t dispersion,
+						  Color color, GO_Draw draw);
 
+/** Register the gameobjects of the game and compile their rules */
 void init_gameobjects();
 
 #endif // _GAMEOBJECTS_H
@@ -20,6 +20,155 @@ static size_t _fseed_ = SIZE_MAX;
 void   sfrand(size_t seed) { _fseed_ = seed; }
 size_t fast_rand() { return fast_rand_impl(&_fseed_); }
 
+/* ========================================================================= */
+/* Philox Random */
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+/* Multipliers and Weyl key increments from Salmon et al., "Parallel random
+ * numbers: as easy as 1, 2, 3" */
+#define PHILOX_M0	  0xD2511F53
+#define PHILOX_M1	  0xCD9E8D57
+#define PHILOX_W0	  0x9E3779B9
+#define PHILOX_W1	  0xBB67AE85
+#define PHILOX_ROUNDS 10
+
+void philox4x32(const uint32_t ctr[4], const uint32_t key[2], uint32_t out[4]) {
+	uint32_t c0 = ctr[0], c1 = ctr[1], c2 = ctr[2], c3 = ctr[3];
+	uint32_t k0 = key[0], k1 = key[1];
+
+	for (size_t r = 0; r < PHILOX_ROUNDS; ++r) {
+		const uint64_t p0 = (uint64_t)PHILOX_M0 * c0;
+		const uint64_t p1 = (uint64_t)PHILOX_M1 * c2;
+
+		c0 = (uint32_t)(p1 >> 32) ^ c1 ^ k0;
+		c1 = (uint32_t)p1;
+		c2 = (uint32_t)(p0 >> 32) ^ c3 ^ k1;
+		c3 = (uint32_t)p0;
+
+		k0 += PHILOX_W0;
+		k1 += PHILOX_W1;
+	}
+
+	out[0] = c0;
+	out[1] = c1;
+	out[2] = c2;
+	out[3] = c3;
+}
+
+/* The counter is (tick, x, y), the world seed is the key */
+#define CELL_RAND_CTR(_tick, _x, _y)                                           \
+	{(uint32_t)(_tick), (uint32_t)(_x), (uint32_t)(_y),                        \
+	 (uint32_t)((uint64_t)(_tick) >> 32)}
+#define CELL_RAND_KEY(_seed)                                                   \
+	{(uint32_t)(_seed), (uint32_t)((uint64_t)(_seed) >> 32)}
+
+uint32_t cell_rand(size_t seed, size_t tick, size_t x, size_t y) {
+	const uint32_t ctr[4] = CELL_RAND_CTR(tick, x, y);
+	const uint32_t key[2] = CELL_RAND_KEY(seed);
+	uint32_t	   out[4];
+	philox4x32(ctr, key, out);
+	return out[0];
+}
+
+#if defined(__AVX2__)
+/** Low and high halves of the 32x32 products of the 8 lanes of a by m */
+static inline void mulhilo_avx2(const __m256i a, const uint32_t m, __m256i *lo,
+								__m256i *hi) {
+	const __m256i mv   = _mm256_set1_epi32(m);
+	const __m256i even = _mm256_mul_epu32(a, mv);
+	const __m256i odd  = _mm256_mul_epu32(_mm256_srli_epi64(a, 32), mv);
+
+	*lo = _mm256_blend_epi32(even, _mm256_slli_epi64(odd, 32), 0xAA);
+	*hi = _mm256_blend_epi32(_mm256_srli_epi64(even, 32), odd, 0xAA);
+}
+
+void cell_rand_batch(size_t seed, size_t tick, size_t x, size_t dx, size_t y,
+					 uint32_t out[CELL_RAND_BATCH]) {
+	const uint32_t key[2] = CELL_RAND_KEY(seed);
+	const uint32_t ctr[4] = CELL_RAND_CTR(tick, x, y);
+
+	__m256i c0 = _mm256_set1_epi32(ctr[0]);
+	__m256i c1 = _mm256_add_epi32(
+		_mm256_set1_epi32(ctr[1]),
+		_mm256_mullo_epi32(_mm256_set1_epi32(dx),
+						   _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7)));
+	__m256i c2 = _mm256_set1_epi32(ctr[2]);
+	__m256i c3 = _mm256_set1_epi32(ctr[3]);
+	uint32_t k0 = key[0], k1 = key[1];
+
+	for (size_t r = 0; r < PHILOX_ROUNDS; ++r) {
+		__m256i lo0, hi0, lo1, hi1;
+		mulhilo_avx2(c0, PHILOX_M0, &lo0, &hi0);
+		mulhilo_avx2(c2, PHILOX_M1, &lo1, &hi1);
+
+		c0 = _mm256_xor_si256(_mm256_xor_si256(hi1, c1), _mm256_set1_epi32(k0));
+		c1 = lo1;
+		c2 = _mm256_xor_si256(_mm256_xor_si256(hi0, c3), _mm256_set1_epi32(k1));
+		c3 = lo0;
+
+		k0 += PHILOX_W0;
+		k1 += PHILOX_W1;
+	}
+
+	_mm256_storeu_si256((__m256i *)out, c0);
+}
+#elif defined(__ARM_NEON)
+/** Low and high halves of the 32x32 products of the 4 lanes of a by m */
+static inline void mulhilo_neon(const uint32x4_t a, const uint32_t m,
+								uint32x4_t *lo, uint32x4_t *hi) {
+	const uint32x2_t mv	  = vdup_n_u32(m);
+	const uint64x2_t p_lo = vmull_u32(vget_low_u32(a), mv);
+	const uint64x2_t p_hi = vmull_u32(vget_high_u32(a), mv);
+
+	*lo = vcombine_u32(vmovn_u64(p_lo), vmovn_u64(p_hi));
+	*hi = vcombine_u32(vshrn_n_u64(p_lo, 32), vshrn_n_u64(p_hi, 32));
+}
+
+void cell_rand_batch(size_t seed, size_t tick, size_t x, size_t dx, size_t y,
+					 uint32_t out[CELL_RAND_BATCH]) {
+	const uint32_t key[2]  = CELL_RAND_KEY(seed);
+	const uint32_t ctr[4]  = CELL_RAND_CTR(tick, x, y);
+	const uint32_t lane[4] = {0, 1, 2, 3};
+
+	for (size_t b = 0; b < CELL_RAND_BATCH; b += 4) {
+		uint32x4_t c0 = vdupq_n_u32(ctr[0]);
+		uint32x4_t c1 =
+			vmlaq_n_u32(vdupq_n_u32(ctr[1] + (uint32_t)(b * dx)),
+						vld1q_u32(lane), (uint32_t)dx);
+		uint32x4_t c2 = vdupq_n_u32(ctr[2]);
+		uint32x4_t c3 = vdupq_n_u32(ctr[3]);
+		uint32_t   k0 = key[0], k1 = key[1];
+
+		for (size_t r = 0; r < PHILOX_ROUNDS; ++r) {
+			uint32x4_t lo0, hi0, lo1, hi1;
+			mulhilo_neon(c0, PHILOX_M0, &lo0, &hi0);
+			mulhilo_neon(c2, PHILOX_M1, &lo1, &hi1);
+
+			c0 = veorq_u32(veorq_u32(hi1, c1), vdupq_n_u32(k0));
+			c1 = lo1;
+			c2 = veorq_u32(veorq_u32(hi0, c3), vdupq_n_u32(k1));
+			c3 = lo0;
+
+			k0 += PHILOX_W0;
+			k1 += PHILOX_W1;
+		}
+
+		vst1q_u32(out + b, c0);
+	}
+}
+#else
+void cell_rand_batch(size_t seed, size_t tick, size_t x, size_t dx, size_t y,
+					 uint32_t out[CELL_RAND_BATCH]) {
+	for (size_t i = 0; i < CELL_RAND_BATCH; ++i)
+		out[i] = cell_rand(seed, tick, x + i * dx, y);
+}
+#endif
+
 /* ========================================================================= */
 /* Mersenne Twister Random */
 
@@ -162,6 +311,25 @@ double noise2d(double x, double y, seed_t SEED) {
 	return result;
 }
 
+double noise2d_tiled(double x, double y, size_t period, seed_t SEED) {
+	const size_t x_int	= floor(x);
+	const size_t y_int	= floor(y);
+	const double x_frac = x - x_int;
+	const double y_frac = y - y_int;
+	const size_t x0		= x_int % period;
+	const size_t y0		= y_int % period;
+	const size_t x1		= (x_int + 1) % period;
+	const size_t y1		= (y_int + 1) % period;
+	const size_t s		= noise2(x0, y0, SEED);
+	const size_t t		= noise2(x1, y0, SEED);
+	const size_t u		= noise2(x0, y1, SEED);
+	const size_t v		= noise2(x1, y1, SEED);
+	const double low	= smooth_inter(s, t, x_frac);
+	const double high	= smooth_inter(u, v, x_frac);
+	const double result = smooth_inter(low, high, y_frac);
+	return result;
+}
+
 double perlin2d(seed_t SEED, double x, double y, double freq, size_t depth) {
 	double xa  = x * freq;
 	double ya  = y * freq;
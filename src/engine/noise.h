@@ -18,6 +18,23 @@ size_t fast_rand();
 /** fast_rand implementation for external seed manipulation */
 size_t fast_rand_impl(size_t *seed);
 
+/**
+ * \brief Philox4x32-10 counter-based random generator
+ * \details Stateless: the output only depends on the counter and the key, so
+ * it can be drawn in any order, from any thread, and still be reproducible.
+ */
+void philox4x32(const uint32_t ctr[4], const uint32_t key[2], uint32_t out[4]);
+
+/** Random number of the cell (x, y) in the tick of a world seed */
+uint32_t cell_rand(size_t seed, size_t tick, size_t x, size_t y);
+
+#define CELL_RAND_BATCH 8
+
+/** cell_rand() of CELL_RAND_BATCH cells of a row, from x every dx cells. Uses
+ * AVX2 or NEON when available, it gives the same numbers anyway. */
+void cell_rand_batch(size_t seed, size_t tick, size_t x, size_t dx, size_t y,
+					 uint32_t out[CELL_RAND_BATCH]);
+
 /** Set the seed for mt_rand */
 void mt_seed(size_t seed);
 
@@ -44,6 +61,13 @@ size_t noise2(size_t x, size_t y, seed_t SEED);
  */
 double noise2d(double x, double y, seed_t SEED);
 
+/**
+ * \brief Smooth noise like noise2d that repeats every period units
+ * \details The corners of the grid wrap around, so the noise tiles seamlessly.
+ * \returns 0.0-255.0 number
+ */
+double noise2d_tiled(double x, double y, size_t period, seed_t SEED);
+
 /**
  * \brief Generate a pseudo-random Perlin noise for a specific location
  */
@@ -0,0 +1,21 @@
+#include "tickclock.h"
+
+void tickclock_init(TickClock *clock, size_t rate, size_t max_ticks) {
+	clock->period	 = SDL_GetPerformanceFrequency() / rate;
+	clock->pending	 = 0;
+	clock->max_ticks = max_ticks;
+}
+
+size_t tickclock_advance(TickClock *clock, Uint64 elapsed) {
+	clock->pending += elapsed;
+
+	size_t ticks = clock->pending / clock->period;
+	if (ticks > clock->max_ticks) {
+		/* Too far behind, forget about the time that can't be caught up */
+		ticks		   = clock->max_ticks;
+		clock->pending = clock->period * ticks;
+	}
+
+	clock->pending -= clock->period * ticks;
+	return ticks;
+}
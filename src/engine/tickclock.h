@@ -0,0 +1,39 @@
+#ifndef _TICKCLOCK_H
+#define _TICKCLOCK_H
+
+#include <SDL.h>
+#include <stddef.h>
+
+/* Cellular automaton and physics rates, in ticks per second. Rendering goes
+ * on its own, as fast as vsync lets it. */
+#define SIM_TICK_RATE	  30
+#define PHYSICS_TICK_RATE 60
+#define PHYSICS_DELTA	  (1.0f / PHYSICS_TICK_RATE)
+
+/* Rate of frame_cx, that moves clouds and water at the same speed at any
+ * render rate */
+#define ANIM_TICK_RATE 60
+
+/* Sim ticks between two rebuilds of the soil colliders, they are expensive */
+#define SOIL_RECALC_TICKS 2
+
+/* Ticks a clock may catch up in a single frame. Beyond that the time is
+ * dropped, so a slow machine sees a slower world instead of frames that take
+ * longer and longer to simulate. */
+#define TICK_MAX_CATCHUP 4
+
+/** Fixed timestep scheduler, it runs as many ticks as the elapsed time pays */
+typedef struct _TickClock {
+	Uint64 period;	  /* Length of a tick, in performance counter units */
+	Uint64 pending;	  /* Elapsed time not simulated yet */
+	size_t max_ticks; /* Ticks that can be run at once */
+} TickClock;
+
+/** Start a clock of rate ticks per second, that catches up max_ticks at most */
+void tickclock_init(TickClock *clock, size_t rate, size_t max_ticks);
+
+/** Add the elapsed time, in performance counter units, and return the number
+ * of ticks to run now */
+size_t tickclock_advance(TickClock *clock, Uint64 elapsed);
+
+#endif /* _TICKCLOCK_H */
@@ -2,6 +2,12 @@
 
 #include <stdio.h>
 
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
 #include "../log/log.h"
 
 SDL_Window	 *__window	 = NULL;
@@ -72,7 +78,8 @@ void Render_init(const char *WINDOW_TITLE, uint32_t WINDOW_WIDTH,
 	__vscreen = SDL_CreateTexture(__renderer, COLOR_PIXELFORMAT,
 								  SDL_TEXTUREACCESS_STREAMING, VIEWPORT_WIDTH,
 								  VIEWPORT_HEIGHT);
-	SDL_SetTextureBlendMode(__vscreen, SDL_BLENDMODE_BLEND);
+	/* The screen is composed opaque, it's copied without blending */
+	SDL_SetTextureBlendMode(__vscreen, SDL_BLENDMODE_NONE);
 
 	SDL_SetRenderTarget(__renderer, NULL);
 	SDL_SetRenderDrawBlendMode(__renderer, SDL_BLENDMODE_BLEND);
@@ -80,6 +87,23 @@ void Render_init(const char *WINDOW_TITLE, uint32_t WINDOW_WIDTH,
 	SDL_RenderClear(__renderer);
 }
 
+Color *Render_LockScreen(size_t *pitch) {
+	void *pixels;
+	int	  pitch_bytes;
+	if (0 != SDL_LockTexture(__vscreen, NULL, &pixels, &pitch_bytes)) {
+		logerr("Error locking screen texture: %s", SDL_GetError());
+		return NULL;
+	}
+
+	*pitch = pitch_bytes / sizeof(Color);
+	return pixels;
+}
+
+void Render_UnlockScreen() {
+	SDL_UnlockTexture(__vscreen);
+	SDL_RenderCopy(__renderer, __vscreen, NULL, NULL);
+}
+
 void Render_Rescale(float scalex, float scaley) {
 	/* Save user-defined render target */
 	SDL_Texture *__rtex = SDL_GetRenderTarget(__renderer);
@@ -244,18 +268,102 @@ void Render_subimage_ext(SDL_Texture *texture, int image_x, int image_y, int w,
 					 flip);
 }
 
+/** x / 255 rounded, exact for every x up to 255 * 255 */
+static inline uint32_t div255(uint32_t x) {
+	x += 128;
+	return (x + (x >> 8)) >> 8;
+}
+
 Color Color_blend(Color src, Color dst) {
-	/* Normalize alpha */
-	float alpha		= src.a / 255.0f;
-	float inv_alpha = 1.0f - alpha;
+	/* Weight of dst, alpha is kept in [0, 255] to blend with integers */
+	const uint32_t inv_alpha = 255 - src.a;
 
-	Color out = {0};
+	Color out;
 
 	/* Blend each channel */
-	out.r = (uint8_t)(src.r * alpha + dst.r * inv_alpha);
-	out.g = (uint8_t)(src.g * alpha + dst.g * inv_alpha);
-	out.b = (uint8_t)(src.b * alpha + dst.b * inv_alpha);
-	out.a = src.a + (dst.a * inv_alpha);
+	out.r = div255(src.r * src.a + dst.r * inv_alpha);
+	out.g = div255(src.g * src.a + dst.g * inv_alpha);
+	out.b = div255(src.b * src.a + dst.b * inv_alpha);
+	out.a = div255(src.a * 255 + dst.a * inv_alpha);
 
 	return out;
 }
+
+#if defined(__AVX2__)
+/** Blend the 4 pixels of s into the ones of d, with a channel in each 16 bit
+ * lane */
+static inline __m256i blend_epi16_avx2(const __m256i s, const __m256i d) {
+	const __m256i c128 = _mm256_set1_epi16(128);
+	const __m256i c255 = _mm256_set1_epi16(255);
+
+	/* Alpha of the pixel on every lane, and 255 on the alpha lane of the src
+	 * weight so the alphas add up like in Color_blend() */
+	const __m256i alpha =
+		_mm256_shufflehi_epi16(_mm256_shufflelo_epi16(s, 0xFF), 0xFF);
+	const __m256i weight	= _mm256_blend_epi16(alpha, c255, 0x88);
+	const __m256i inv_alpha = _mm256_sub_epi16(c255, alpha);
+
+	__m256i t = _mm256_add_epi16(_mm256_mullo_epi16(s, weight),
+								 _mm256_mullo_epi16(d, inv_alpha));
+
+	/* div255() */
+	t = _mm256_add_epi16(t, c128);
+	return _mm256_srli_epi16(_mm256_add_epi16(t, _mm256_srli_epi16(t, 8)), 8);
+}
+
+void Color_blend_span(Color *dst, const Color *src, size_t n) {
+	const __m256i zero = _mm256_setzero_si256();
+
+	size_t i = 0;
+	for (; i + 8 <= n; i += 8) {
+		const __m256i s = _mm256_loadu_si256((const __m256i *)&src[i]);
+		const __m256i d = _mm256_loadu_si256((const __m256i *)&dst[i]);
+
+		const __m256i lo = blend_epi16_avx2(_mm256_unpacklo_epi8(s, zero),
+											_mm256_unpacklo_epi8(d, zero));
+		const __m256i hi = blend_epi16_avx2(_mm256_unpackhi_epi8(s, zero),
+											_mm256_unpackhi_epi8(d, zero));
+
+		_mm256_storeu_si256((__m256i *)&dst[i], _mm256_packus_epi16(lo, hi));
+	}
+
+	for (; i < n; ++i)
+		dst[i] = Color_blend(src[i], dst[i]);
+}
+#elif defined(__ARM_NEON)
+/** s * ws + d * wd / 255, rounded like div255() */
+static inline uint8x8_t blend_u8_neon(const uint8x8_t s, const uint8x8_t ws,
+									  const uint8x8_t d, const uint8x8_t wd) {
+	const uint16x8_t t = vmlal_u8(vmull_u8(s, ws), d, wd);
+	return vrshrn_n_u16(vrsraq_n_u16(t, t, 8), 8);
+}
+
+void Color_blend_span(Color *dst, const Color *src, size_t n) {
+	const uint8x8_t c255 = vdup_n_u8(255);
+
+	size_t i = 0;
+	for (; i + 8 <= n; i += 8) {
+		/* Every channel of the 8 pixels in its own register */
+		const uint8x8x4_t s = vld4_u8((const uint8_t *)&src[i]);
+		uint8x8x4_t		  d = vld4_u8((const uint8_t *)&dst[i]);
+
+		const uint8x8_t alpha	  = s.val[3];
+		const uint8x8_t inv_alpha = vmvn_u8(alpha);
+
+		d.val[0] = blend_u8_neon(s.val[0], alpha, d.val[0], inv_alpha);
+		d.val[1] = blend_u8_neon(s.val[1], alpha, d.val[1], inv_alpha);
+		d.val[2] = blend_u8_neon(s.val[2], alpha, d.val[2], inv_alpha);
+		d.val[3] = blend_u8_neon(s.val[3], c255, d.val[3], inv_alpha);
+
+		vst4_u8((uint8_t *)&dst[i], d);
+	}
+
+	for (; i < n; ++i)
+		dst[i] = Color_blend(src[i], dst[i]);
+}
+#else
+void Color_blend_span(Color *dst, const Color *src, size_t n) {
+	for (size_t i = 0; i < n; ++i)
+		dst[i] = Color_blend(src[i], dst[i]);
+}
+#endif
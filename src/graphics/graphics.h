@@ -50,6 +50,14 @@ extern SDL_Texture	*__vscreen;
 void Render_init(const char *WINDOW_TITLE, uint32_t WINDOW_WIDTH,
 				 uint32_t WINDOW_HEIGHT);
 
+/** Lock the screen texture to write its pixels, it returns the first row and
+ * the distance between rows in pitch, in colors. The pixels are write-only, and
+ * must all be written. NULL if the texture can't be locked. */
+Color *Render_LockScreen(size_t *pitch);
+
+/** Upload the pixels written to the screen and copy it to the renderer */
+void Render_UnlockScreen();
+
 void Render_Rescale(float scalex, float scaley);
 void Render_SetPosition(int x, int y);
 void Render_SetPositionAndScale(int x, int y, float scalex, float scaley);
@@ -145,6 +153,12 @@ void Render_subimage_ext(SDL_Texture *texture, int image_x, int image_y, int w,
  */
 Color Color_blend(Color src, Color dst);
 
+/**
+ * \brief Blend the n colors of src into the ones of dst, pixel by pixel. It
+ * gives the same colors as Color_blend(), 8 pixels at a time with SIMD.
+ */
+void Color_blend_span(Color *dst, const Color *src, size_t n);
+
 #ifdef __cplusplus
 }
 #endif
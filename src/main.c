@@ -21,6 +21,7 @@
 #include "engine/entities.h"
 #include "engine/gameobjects.h"
 #include "engine/noise.h"
+#include "engine/tickclock.h"
 #include "graphics/color.h"
 #include "graphics/font/font.h"
 #include "graphics/graphics.h"
@@ -46,8 +47,11 @@ void F_PANIC_SAVE() {
 		}
 	}
 
-	/* Save cached chunks */
-	cache_chunk_flushall();
+	/* Save cached chunks, and wait for the writer to get them to disk */
+	bool saved = cache_chunk_flushall();
+	saved &= chunk_writer_flush();
+	if (!saved)
+		logerr("F_PANIC_SAVE: Some chunks couldn't be saved");
 }
 
 void F_QUITGAME() { GAME_ON = false; }
@@ -59,101 +63,220 @@ void F_RESUME() {
 /** Handle `CTRL + C` to quit the game */
 void sigkillHandler(int signum) { GAME_ON = false; }
 
-void draw_sky(SDL_FRect *camera) {
-	const size_t y1 = GEN_SKY_Y * 384;
-	const size_t y2 = GEN_TOP_LAYER_Y * 384;
-	const size_t y3 = (GEN_TOP_LAYER_Y + 4) * 384;
-	const size_t y4 = CHUNK_MAX_Y * 384;
-
-	const size_t y1_clouds_dense = (GEN_SKY_Y + 4) * 384;
-
+/* World heights where the sky colors are reached, from the top */
+#define SKY_Y1				(GEN_SKY_Y * 384)
+#define SKY_Y2				(GEN_TOP_LAYER_Y * 384)
+#define SKY_Y3				((GEN_TOP_LAYER_Y + 4) * 384)
+#define SKY_Y4				(CHUNK_MAX_Y * 384)
+#define SKY_Y1_CLOUDS_DENSE ((GEN_SKY_Y + 4) * 384)
+#define SKY_HEIGHT			((CHUNK_MAX_Y + 1) * 384)
+
+/* Sky color of every world row */
+static Color m_sky_gradient[SKY_HEIGHT];
+
+/* Clouds are sampled every SKY_CLOUD_CELL cells and scaled up. The samples are
+ * kept in a ring larger than the camera, so only the ones that the clouds or
+ * the camera move onto are sampled again. */
+#define SKY_CLOUD_CELL 4
+#define SKY_CLOUD_COLS 128
+#define SKY_CLOUD_ROWS 64
+
+typedef struct _CloudSample {
+	size_t i; /* Cell where it was sampled */
+	size_t j;
+	float  nv;
+} CloudSample;
+static CloudSample m_cloud_samples[SKY_CLOUD_ROWS][SKY_CLOUD_COLS];
+
+void init_sky() {
 	const Color color0 = C_WHITE;
 	const Color color1 = {000, 191, 255}; /* Sky top */
 	const Color color2 = {135, 206, 250}; /* Sky bottom */
 	const Color color3 = {105, 126, 140}; /* Rock top */
 	const Color color4 = C_BLACK;
 
-	const Chunk tlchunk = vctable[0][0];
-
-	const size_t cam_wy = tlchunk.y * CHUNK_SIZE + ((size_t)camera->y);
-	const size_t cam_wx = tlchunk.x * CHUNK_SIZE + ((size_t)camera->x);
-
-	/* Draw color gradient */
-	for (size_t y = 0; y < VIEWPORT_HEIGHT; ++y) {
-		const size_t world_y = cam_wy + y;
-
-		/* Calculate color line depending on the camera y */
+	for (size_t world_y = 0; world_y < SKY_HEIGHT; ++world_y) {
 		Color color;
 		color.a = 0xFF;
 
 		float t;
 
-		if (world_y <= y1) {
-			t		= (float)world_y / (float)y1;
+		if (world_y <= SKY_Y1) {
+			t		= (float)world_y / (float)SKY_Y1;
 			color.r = (uint8_t)(color0.r + t * (color1.r - color0.r));
 			color.g = (uint8_t)(color0.g + t * (color1.g - color0.g));
 			color.b = (uint8_t)(color0.b + t * (color1.b - color0.b));
-		} else if (world_y <= y2) {
-			t		= (float)(world_y - y1) / (float)(y2 - y1);
+		} else if (world_y <= SKY_Y2) {
+			t		= (float)(world_y - SKY_Y1) / (float)(SKY_Y2 - SKY_Y1);
 			color.r = (uint8_t)(color1.r + t * (color2.r - color1.r));
 			color.g = (uint8_t)(color1.g + t * (color2.g - color1.g));
 			color.b = (uint8_t)(color1.b + t * (color2.b - color1.b));
-		} else if (world_y <= y3) {
-			t		= (float)(world_y - y2) / (float)(y3 - y2);
+		} else if (world_y <= SKY_Y3) {
+			t		= (float)(world_y - SKY_Y2) / (float)(SKY_Y3 - SKY_Y2);
 			color.r = (uint8_t)(color2.r + t * (color3.r - color2.r));
 			color.g = (uint8_t)(color2.g + t * (color3.g - color2.g));
 			color.b = (uint8_t)(color2.b + t * (color3.b - color2.b));
 		} else {
-			t		= (float)(world_y - y3) / (float)(y4 - y3);
+			t		= (float)(world_y - SKY_Y3) / (float)(SKY_Y4 - SKY_Y3);
 			color.r = (uint8_t)(color3.r + t * (color4.r - color3.r));
 			color.g = (uint8_t)(color3.g + t * (color4.g - color3.g));
 			color.b = (uint8_t)(color3.b + t * (color4.b - color3.b));
 		}
 
-		/* Render line */
-		for (size_t x = 0; x < VIEWPORT_WIDTH; ++x)
-			vscreen[vscreen_idx(x, y)] = color;
+		m_sky_gradient[world_y] = color;
 	}
 
-	/* Draw clouds */
-	for (size_t y = 0; y < VIEWPORT_HEIGHT; ++y) {
-		const size_t world_y = cam_wy + y;
+	/* No cloud sampled yet */
+	for (size_t j = 0; j < SKY_CLOUD_ROWS; ++j) {
+		for (size_t i = 0; i < SKY_CLOUD_COLS; ++i)
+			m_cloud_samples[j][i].i = SIZE_MAX;
+	}
+}
 
-		/* Do not calculate for invalid heights */
-		if (world_y < y1 || world_y > y2)
-			continue;
+/** Cloud noise at the cell (i, j), sampled if it's not in the ring */
+static float cloud_sample(const size_t i, const size_t j) {
+	CloudSample *sample =
+		&m_cloud_samples[j % SKY_CLOUD_ROWS][i % SKY_CLOUD_COLS];
+	if (sample->i != i || sample->j != j) {
+		sample->i  = i;
+		sample->j  = j;
+		sample->nv = perlin2d(WORLD_SEED, (double)(i * SKY_CLOUD_CELL),
+							  (double)(j * SKY_CLOUD_CELL), 0.01, 2);
+	}
+	return sample->nv;
+}
 
-		for (size_t x = 0; x < VIEWPORT_WIDTH; ++x) {
-			const size_t world_x = cam_wx + x;
+/** The sky under the camera in a frame, to be drawn row by row */
+typedef struct _SkyView {
+	size_t cam_wy;
+	size_t y0, y1; /* Rows of the camera with clouds */
+	size_t u0, v0; /* Noise position of the camera */
+	size_t i0, j0; /* First cloud sample around the cloud rows */
+	size_t ni;
+	float  samples[VIEWPORT_HEIGHT / SKY_CLOUD_CELL + 2]
+				 [VIEWPORT_WIDTH / SKY_CLOUD_CELL + 2];
+} SkyView;
+
+/** Prepare the sky under the camera for draw_sky_row() */
+static void view_sky(const SDL_FRect *camera, SkyView *sky) {
+	const Chunk tlchunk = vctable[0][0];
 
-			double nv = perlin2d(WORLD_SEED, (double)(world_x + frame_cx),
-								 (double)(world_y + frame_cx), 0.01, 2);
+	const size_t cam_wy = tlchunk.y * CHUNK_SIZE + ((size_t)camera->y);
+	const size_t cam_wx = tlchunk.x * CHUNK_SIZE + ((size_t)camera->x);
+	sky->cam_wy			= cam_wy;
 
-			/* Make clouds smaller with height */
-			if (world_y > y1_clouds_dense)
-				nv -= ((double)world_y - y1_clouds_dense) /
-					  (double)(y3 - y1_clouds_dense);
+	/* Rows with clouds, that are the ones between the heights of the sky */
+	if (cam_wy + VIEWPORT_HEIGHT_M1 < SKY_Y1 || cam_wy > SKY_Y2) {
+		sky->y0 = sky->y1 = 0;
+		return;
+	}
+	sky->y0 = clamp_low(cam_wy, SKY_Y1) - cam_wy;
+	sky->y1 = clamp_high(cam_wy + VIEWPORT_HEIGHT_M1, SKY_Y2) + 1 - cam_wy;
+
+	/* Clouds move a cell down and right every frame */
+	sky->u0 = cam_wx + frame_cx;
+	sky->v0 = cam_wy + frame_cx;
+
+	/* Samples around the cloud rows of the camera */
+	sky->i0 = sky->u0 / SKY_CLOUD_CELL;
+	sky->j0 = (sky->v0 + sky->y0) / SKY_CLOUD_CELL;
+	sky->ni = (sky->u0 + VIEWPORT_WIDTH_M1) / SKY_CLOUD_CELL + 2 - sky->i0;
+	const size_t nj =
+		(sky->v0 + sky->y1 - 1) / SKY_CLOUD_CELL + 2 - sky->j0;
+
+	for (size_t j = 0; j < nj; ++j) {
+		for (size_t i = 0; i < sky->ni; ++i)
+			sky->samples[j][i] = cloud_sample(sky->i0 + i, sky->j0 + j);
+	}
+}
 
-			/* Threshold to contrast clouds with sky */
-			if (nv < 0.5)
-				continue;
-			else if (nv < 0.7) {
-				/* Create halo effect so clouds don't look like bricks */
-				/* Linearly map nv from [0.5, 0.7] to [0, 0.7] */
-				nv = (nv - 0.5) * 3.5;
-			}
+/** Draw the sky gradient and the clouds of the row y of the camera into the
+ * VIEWPORT_WIDTH colors of line */
+static void draw_sky_row(const SkyView *sky, const size_t y, Color *line) {
+	const size_t world_y = sky->cam_wy + y;
 
-			Color cloud_point_color = {0xFF, 0xFF, 0xFF, 0x00};
-			cloud_point_color.a += (uint8_t)(nv * 0xBC);
-			/* Blend cloud point */
-			vscreen[vscreen_idx(x, y)] =
-				Color_blend(cloud_point_color, vscreen[vscreen_idx(x, y)]);
+	/* Draw color gradient */
+	const Color color = m_sky_gradient[world_y];
+	for (size_t x = 0; x < VIEWPORT_WIDTH; ++x)
+		line[x] = color;
+
+	if (y < sky->y0 || y >= sky->y1)
+		return;
+
+	/* Scale the cloud samples up, between their rows first */
+	const size_t v	= sky->v0 + y;
+	const size_t j	= v / SKY_CLOUD_CELL - sky->j0;
+	const float	 fv = (float)(v % SKY_CLOUD_CELL) / SKY_CLOUD_CELL;
+
+	float row[VIEWPORT_WIDTH / SKY_CLOUD_CELL + 2];
+	for (size_t i = 0; i < sky->ni; ++i)
+		row[i] = sky->samples[j][i] +
+				 (sky->samples[j + 1][i] - sky->samples[j][i]) * fv;
+
+	/* Make clouds smaller with height */
+	float fade = 0.0f;
+	if (world_y > SKY_Y1_CLOUDS_DENSE)
+		fade = ((double)world_y - SKY_Y1_CLOUDS_DENSE) /
+			   (double)(SKY_Y3 - SKY_Y1_CLOUDS_DENSE);
+
+	/* Cloud points of the row, transparent where there are none */
+	Color clouds[VIEWPORT_WIDTH];
+	bool  cloudy = false;
+	for (size_t x = 0; x < VIEWPORT_WIDTH; ++x) {
+		const size_t u	= sky->u0 + x;
+		const size_t i	= u / SKY_CLOUD_CELL - sky->i0;
+		const float	 fu = (float)(u % SKY_CLOUD_CELL) / SKY_CLOUD_CELL;
+
+		float nv = row[i] + (row[i + 1] - row[i]) * fu - fade;
+
+		/* Threshold to contrast clouds with sky */
+		if (nv < 0.5f) {
+			clouds[x] = C_TRANS;
+			continue;
+		} else if (nv < 0.7f) {
+			/* Create halo effect so clouds don't look like bricks */
+			/* Linearly map nv from [0.5, 0.7] to [0, 0.7] */
+			nv = (nv - 0.5f) * 3.5f;
 		}
+
+		Color cloud_point_color = {0xFF, 0xFF, 0xFF, 0x00};
+		cloud_point_color.a += (uint8_t)(nv * 0xBC);
+		clouds[x] = cloud_point_color;
+		cloudy	  = true;
+	}
+
+	/* Blend cloud points */
+	if (cloudy)
+		Color_blend_span(line, clouds, VIEWPORT_WIDTH);
+}
+
+/** Compose the sky, the player and the world under the camera into the screen
+ * in a single pass, and copy it to the renderer. Every row is composed in a
+ * line that stays in cache, the screen texture is only written. The rows are
+ * split in bands across the cores. */
+void draw_view(SDL_FRect *camera, const Player *player) {
+	SkyView sky;
+	view_sky(camera, &sky);
+	draw_gameboard_world(camera);
+
+	static PlayerLayer player_layer;
+	draw_player(player, camera, &player_layer);
+
+	size_t pitch;
+	Color *pixels = Render_LockScreen(&pitch);
+	if (pixels == NULL)
+		return;
+
+#pragma omp parallel for schedule(static, DRAW_BAND_ROWS) if (PARALLEL_DRAW)
+	for (size_t y = 0; y < VIEWPORT_HEIGHT; ++y) {
+		Color line[VIEWPORT_WIDTH];
+		draw_sky_row(&sky, y, line);
+		blend_player_row(&player_layer, y, line);
+		blend_gameboard_row(camera, y, line);
+		memcpy(&pixels[y * pitch], line, vscreen_line_size);
 	}
 
-	/* Render pixels to vscreen and copy to renderer */
-	SDL_UpdateTexture(__vscreen, NULL, vscreen, vscreen_line_size);
-	SDL_RenderCopy(__renderer, __vscreen, NULL, NULL);
+	Render_UnlockScreen();
 }
 
 int main(int argc, char *argv[]) {
@@ -180,10 +303,19 @@ int main(int argc, char *argv[]) {
 	/* =============================================================== */
 	/* Init stuff */
 	disk_init();
-	cache_chunk_init();
+	cache_chunk_init(clamp(SDL_GetSystemRAM() / CHUNK_CACHE_RAM_SHARE,
+						   CHUNK_CACHE_MIN_MB, CHUNK_CACHE_MAX_MB),
+					 true);
 	atexit(F_PANIC_SAVE);
 	init_gameobjects();
 
+	/* Parallel update and draw only pay off with more than one core */
+	PARALLEL_UPDATE = PARALLEL_UPDATE && SDL_GetCPUCount() > 1;
+	PARALLEL_DRAW	= PARALLEL_DRAW && SDL_GetCPUCount() > 1;
+
+	/* Chunks are generated on the cores left, if any */
+	chunk_stage_init(SDL_GetCPUCount() - 1);
+
 	/* Initialize soil */
 	for (uint_fast8_t __j = 0; __j < SUBCHUNK_SIZE; ++__j) {
 		for (uint_fast8_t __i = 0; __i < SUBCHUNK_SIZE; ++__i) {
@@ -231,6 +363,7 @@ int main(int argc, char *argv[]) {
 		.y		  = GEN_SKY_Y - 1,
 		.modified = 0,
 	};
+	init_sky();
 
 	/* Initialize world chunks and vctable */
 	chunk_xaxis_t chunk_start_x = player.chunk_id.x - 1;
@@ -247,16 +380,7 @@ int main(int argc, char *argv[]) {
 			const size_t vx = (i - chunk_start_x) * CHUNK_SIZE;
 			const size_t vy = (j - chunk_start_y) * CHUNK_SIZE;
 
-			/* Load chunk from disk or generate it */
-			GO_ID chunk_data_disk[CHUNK_MEMSIZE];
-			if (load_chunk_from_disk(chunk, chunk_data_disk)) {
-				for (size_t __k = 0; __k < CHUNK_SIZE; ++__k) {
-					memcpy(&gameboard[(vy + __k)][vx],
-						   (chunk_data_disk) + (__k * CHUNK_SIZE), CHUNK_SIZE);
-				}
-			} else {
-				generate_chunk(WORLD_SEED, chunk, vx, vy);
-			}
+			load_chunk(chunk, vx, vy);
 		}
 	}
 	ResetSubchunks;
@@ -282,6 +406,16 @@ int main(int argc, char *argv[]) {
 	Uint32 prevTicks  = SDL_GetTicks();
 	Uint32 frameTicks = 0;
 
+	/* The world runs at fixed rates, whatever the render rate is. Animations
+	 * drop the same time as the sim when it can't catch up. */
+	TickClock sim_clock, physics_clock, anim_clock;
+	tickclock_init(&sim_clock, SIM_TICK_RATE, TICK_MAX_CATCHUP);
+	tickclock_init(&physics_clock, PHYSICS_TICK_RATE, TICK_MAX_CATCHUP);
+	tickclock_init(&anim_clock, ANIM_TICK_RATE,
+				   TICK_MAX_CATCHUP * ANIM_TICK_RATE / SIM_TICK_RATE);
+	size_t render_frames = 0;
+	Uint64 prevCounter = SDL_GetPerformanceCounter();
+
 	/* =============================================================== */
 	/* GAME LOOP */
 	while (GAME_ON) {
@@ -291,6 +425,10 @@ int main(int argc, char *argv[]) {
 		float  dt			= (float)delta / 1000.0;
 		prevTicks			= currentTicks;
 
+		const Uint64 currentCounter = SDL_GetPerformanceCounter();
+		const Uint64 elapsed		= currentCounter - prevCounter;
+		prevCounter					= currentCounter;
+
 		/* =============================================================== */
 		/* Get inputs */
 		static bool	 LCTRL;
@@ -458,8 +596,7 @@ int main(int argc, char *argv[]) {
 			}
 
 			if (block_size == 1) {
-				gameboard[mouse_wold_y][mouse_wold_x] = current_object;
-				subchunk_set_world(mouse_wold_x, mouse_wold_y);
+				gameboard_set(mouse_wold_x, mouse_wold_y, current_object);
 				/* Mark Chunk at mouse position as modified */
 				vctable[(mouse_wold_x / CHUNK_SIZE)]
 					   [(mouse_wold_y / CHUNK_SIZE)]
@@ -479,8 +616,7 @@ int main(int argc, char *argv[]) {
 					for (int_fast16_t i = clamp_low(bx - block_size / 2, 0);
 						 i < clamp_high(bx + block_size / 2, VSCREEN_WIDTH);
 						 ++i) {
-						gameboard[j][i] = current_object;
-						subchunk_set_world(i, j);
+						gameboard_set(i, j, current_object);
 						/* Mark Chunk at brush size position as modified */
 						vctable[(i / CHUNK_SIZE)][(j / CHUNK_SIZE)].modified =
 							1;
@@ -497,13 +633,16 @@ int main(int argc, char *argv[]) {
 		else
 			canvas_process(&pause_canvas, mouse_buttons, mouse_x, mouse_y);
 
-		box2d_world_step(b2_world, FPS_DELTA, 10, 8);
+		for (size_t t = tickclock_advance(&physics_clock, elapsed); t > 0; --t)
+			box2d_world_step(b2_world, PHYSICS_DELTA, 10, 8);
 
 		/* Calculate soil collisions around player */
 		const size_t si = (size_t)(player.x) / SUBCHUNK_WIDTH;
 		const size_t sj = (size_t)(player.y) / SUBCHUNK_HEIGHT;
 		for (size_t j = sj - 2; j <= sj + 2; ++j) {
 			for (size_t i = si - 2; i <= si + 2; ++i) {
+				if (i >= SUBCHUNK_SIZE || j >= SUBCHUNK_SIZE)
+					continue;
 				if (i >= si - 1 && i <= si + 1 && j >= sj - 1 && j <= sj + 1)
 					activate_soil(i, j);
 				else
@@ -511,18 +650,26 @@ int main(int argc, char *argv[]) {
 			}
 		}
 
-		/* Recalculate soil for active subchunks, not every frame since it is
-		 * expensive */
-		if (frame_cx % 4 == 0)
-			for (uint_fast8_t sj = 0; sj < SUBCHUNK_SIZE; ++sj)
-				for (uint_fast8_t si = 0; si < SUBCHUNK_SIZE; ++si)
-					if (is_subchunk_active(si, sj))
-						recalculate_soil(si, sj);
-
 		move_camera(&player, &camera); /* After world_step */
 
+		/* Get the chunks ahead ready and save the ones left behind a bit
+		 * every frame, instead of all at once when crossing a border */
+		chunk_stage_step(CHUNK_STAGE_BUDGET_US);
+		cache_chunk_writeback();
+
 		/* Update gameboard, entities and physics after all */
-		update_gameboard();
+		for (size_t t = tickclock_advance(&sim_clock, elapsed); t > 0; --t) {
+			update_gameboard();
+
+			/* Recalculate soil for active subchunks, not every tick since it
+			 * is expensive */
+			if (sim_tick % SOIL_RECALC_TICKS == 0)
+				for (uint_fast8_t sj = 0; sj < SUBCHUNK_SIZE; ++sj)
+					for (uint_fast8_t si = 0; si < SUBCHUNK_SIZE; ++si)
+						if (is_subchunk_active(si, sj))
+							recalculate_soil(si, sj);
+		}
+		frame_cx += tickclock_advance(&anim_clock, elapsed);
 
 		/* =============================================================== */
 		/* Step animations */
@@ -530,15 +677,10 @@ int main(int argc, char *argv[]) {
 
 		/* =============================================================== */
 		/* Draw game */
-		draw_sky(&camera);
-
-		/* Draw player */
-		draw_player(&player, &camera);
-
-		/* Draw gameboard */
-		draw_gameboard_world(&camera);
+		draw_view(&camera, &player);
 
 		/* Debug draw */
+		draw_gameboard_debug(&camera);
 		if (DBGL(e_dbgl_physics)) {
 			SDL_Rect icamera = {(int)camera.x, (int)camera.y, (int)camera.w,
 								(int)camera.h};
@@ -584,6 +726,15 @@ int main(int argc, char *argv[]) {
 			snprintf(str_xy, sizeof(str_xy), "%i,%i", player.chunk_id.x,
 					 player.chunk_id.y);
 			draw_string(str_xy, 0, 0);
+
+			CacheStats cache;
+			cache_chunk_stats(&cache);
+			char str_cache[64];
+			snprintf(str_cache, sizeof(str_cache),
+					 "cache %zu/%zu+%zu %zuK h%zu m%zu", cache.used,
+					 cache.entries, cache.packed, cache.packed_bytes >> 10,
+					 cache.hits, cache.misses);
+			draw_string(str_cache, 0, BITFONT_CHAR_HEIGHT);
 		}
 
 		if (PAUSED) {
@@ -599,19 +750,21 @@ int main(int argc, char *argv[]) {
 		Render_Update;
 
 		/* =============================================================== */
-		/* Calculate ticks (adjust FPS) */
+		/* Calculate ticks (adjust FPS, in case there is no vsync) */
 		frameTicks = SDL_GetTicks() - currentTicks;
 		if (frameTicks < FRAME_DELAY_MS)
 			SDL_Delay(FRAME_DELAY_MS - frameTicks);
 
-		++frame_cx;
-		if (frame_cx % 4 == 0) {
+		++render_frames;
+		if (render_frames % 4 == 0) {
 			fps_ = CALCULATE_FPS(delta);
 			if (fps_ > FPS - 5)
 				fps_ = FPS;
 		}
 	}
 
+	chunk_stage_quit();
+
 	canvas_delete(&pause_canvas);
 
 	delete (player.sprite);
@@ -130,6 +130,7 @@ typedef struct _CList {
 
 #define repeat(n) __repeat_body(n, _tmp##__COUNTER__##_)
 
-#define PACKED __attribute__((packed))
+#define PACKED	   __attribute__((packed))
+#define ALIGNED(n) __attribute__((aligned(n)))
 
 #endif // _UTILS_H